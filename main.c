@@ -2,380 +2,7528 @@
  * AutoBackupWatch - Directory File Versioning Tool
  * 
  * Watches a directory and creates versioned backups when files change.
- * Uses SHA-256 hashing to detect actual content changes (not just timestamp).
+ * Uses SHA-256 hashing to detect actual content changes (not just timestamp);
+ * --hash selects BLAKE2b or, when built with xxHash, XXH3-128 instead.
  * 
- * Compile: gcc main.c -o autobackup -lssl -lcrypto
- * Usage: ./autobackup <directory_to_watch> [poll_interval_seconds]
+ * Compile: gcc main.c -o autobackup -pthread -lssl -lcrypto
+ *   with XXH3: gcc -DHAVE_XXHASH main.c -o autobackup -pthread -lssl -lcrypto -lxxhash
+ *   with zstd/LZ4 compression: add -DHAVE_ZSTD -lzstd and/or -DHAVE_LZ4 -llz4
+ * Usage: ./autobackup [options] <directory_to_watch> [poll_interval_seconds]
  * Example: ./autobackup ./my_project 5
+ *
+ * On Linux, changes are picked up through inotify as soon as a file is
+ * closed after writing; --poll (or a failed inotify setup) falls back to
+ * rescanning the directory every poll interval.
+ *
+ * With --recursive the whole tree below the watch directory is tracked,
+ * walked in parallel by --threads worker threads. The same number of
+ * threads hashes changed files; backups are then queued for --writers
+ * background threads, so a large copy never holds up change detection.
+ * --single-pass copies each changed file into a staging file while
+ * hashing it, so the backup costs no second read. --dedup stores backup
+ * content once per distinct hash in .autobackup/objects. --chunked splits
+ * large files into content-defined chunks stored the same way, so a new
+ * version only writes the chunks that changed.
+ *
+ * --debounce MS waits until a changed file has been stable for MS
+ * milliseconds before backing it up, so a burst of writes becomes one
+ * backup; --rate-limit SECONDS caps each file at one backup per interval.
+ * In polling mode, files found unchanged are stat'ed exponentially less
+ * often, down to once every --max-poll seconds; a change resets that.
+ *
+ * --io-uring (Linux 5.6+) stats files with batched statx and hashes them
+ * with overlapped reads from a single thread through io_uring, driven by
+ * the raw syscalls; it falls back to blocking I/O where unavailable.
+ *
+ * --keep-last, --keep-hourly, --keep-daily, --keep-weekly and --max-bytes
+ * set a retention policy, applied by a low-priority background thread
+ * that prunes old versions and garbage-collects the object store.
+ *
+ * --sample-large trusts a sampled fingerprint of huge files whose size did
+ * not change instead of re-hashing them completely.
+ *
+ * --compress zstd[:LEVEL] or lz4[:LEVEL] compresses plain backups while
+ * they are copied, as standard .zst / .lz4 frames.
+ *
+ * Plain backups go to .autobackup/versions/<file>/, one directory per
+ * tracked file; --migrate-layout moves an older flat backup directory
+ * into that layout and exits.
+ *
+ * --metrics [HOST:]PORT or unix:PATH serves Prometheus metrics over HTTP;
+ * --stats-interval S prints a summary line every S seconds.
+ *
+ * Every backup is recorded in a per-file version index under
+ * .autobackup/index, one "version|time|algo|hash|size|location" line each.
+ * --log lists versions from it and --restore puts files back as of --at
+ * WHEN (a time or vN), reflinking or kernel-copying stored content.
+ *
+ * Backups are staged and renamed into place. Their version index lines
+ * and the state journal records are held until a group commit: one
+ * syncfs() of the backups written since the last one (at most every
+ * --sync-interval MS), then the index lines, then one fdatasync() of the
+ * journal, so neither names a backup that is not on disk. SIGINT and
+ * SIGTERM finish queued backups and commit before exiting.
  */
 
+#define _GNU_SOURCE  // copy_file_range()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <time.h>
 #include <errno.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <openssl/evp.h>
 
+#ifdef HAVE_XXHASH
+#include <xxhash.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#ifdef __APPLE__
+#define ST_MTIM(st) ((st)->st_mtimespec)
+#define ST_CTIM(st) ((st)->st_ctimespec)
+#else
+#define ST_MTIM(st) ((st)->st_mtim)
+#define ST_CTIM(st) ((st)->st_ctim)
+#endif
+#define TIMESPEC_NS(ts) ((int64_t)(ts).tv_sec * 1000000000 + (ts).tv_nsec)
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  // macOS: metrics sockets get SO_NOSIGPIPE instead
+#endif
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#define HAVE_INOTIFY 1
+#define HAVE_KERNEL_COPY 1
+#ifdef STATX_BASIC_STATS
+#include <sys/sysmacros.h>
+#define HAVE_STATX 1
+// The only fields change detection needs
+#define STATX_SIGNATURE (STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_INO | \
+                         STATX_MTIME | STATX_CTIME)
+#endif
+#if defined(HAVE_STATX) && defined(__has_include) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
 #define MAX_PATH 2048
-#define MAX_FILES 1000
-#define HASH_SIZE 65  // SHA-256 hex string + null terminator
+#define HASH_LEN 32   // Raw digest storage (shorter digests are zero-padded)
+#define HASH_SIZE 65  // Hex string of HASH_LEN bytes + null terminator
+#define NAME_POOL_CHUNK 65536
+#define MAX_THREADS 64
+#define LARGE_FILE_THRESHOLD (256 * 1024)  // Hash files this big with large reads
+#define LARGE_READ_SIZE (1024 * 1024)
+#define COPY_CHUNK (1 << 30)  // Bytes per copy_file_range()/sendfile() call
+#define SAMPLE_MIN_SIZE (64LL * 1024 * 1024)  // Files sampled by --sample-large
+#define SAMPLE_BLOCKS 16      // Blocks read for a sampled fingerprint, head to tail
+#define SAMPLE_BLOCK (64 * 1024)
+#define URING_ENTRIES 64      // Submission queue depth
+#define URING_READS 16        // Files read concurrently by uring_hash_jobs()
+#define URING_READ_SIZE (256 * 1024)
+#define BACKUP_QUEUE_SIZE 256  // Slots per writer queue ring, a power of two
+#define SMALL_BACKUP_SIZE (1024 * 1024)  // Smaller backups jump the queue
+#define LARGE_BACKUP_TURN 8    // A writer takes a large backup first every N tasks
+#define BENCH_ROUNDS 3         // Change-and-check rounds run by --bench
+#define BENCH_DIR_FILES 256    // Generated files per directory with --recursive
+#define BENCH_WRITE_SIZE 4096  // Bytes rewritten in each changed file
+#define HISTOGRAM_BUCKETS 12   // Finite upper bounds in histogram_bounds
+#define METRICS_REQUEST_MAX 4096  // Bytes of an HTTP request read by --metrics
+
+// Content-defined chunking (FastCDC with normalized chunk sizes)
+#define CHUNK_MIN (16 * 1024)
+#define CHUNK_AVG (64 * 1024)
+#define CHUNK_MAX (256 * 1024)
+#define CHUNK_MASK_SMALL (((1ULL << 18) - 1) << 46)  // Harder cut below CHUNK_AVG
+#define CHUNK_MASK_LARGE (((1ULL << 14) - 1) << 50)  // Easier cut above it
+#define CHUNKED_MIN_FILE (1024 * 1024)  // Smaller files are stored whole
 #define BACKUP_DIR ".autobackup"
+#define STAGING_DIR ".staging"  // Inside BACKUP_DIR, holds in-flight copies
+#define OBJECTS_DIR "objects"   // Inside BACKUP_DIR, content-addressed store
+#define INDEX_DIR "index"       // Inside BACKUP_DIR, per-file version history
+#define MANIFESTS_DIR "manifests"  // Inside BACKUP_DIR, chunk lists by file hash
+#define VERSIONS_DIR "versions"    // Inside BACKUP_DIR, plain backups per file
+#define INDEX_SUFFIX ".versions"
+#define STATE_FILE ".autobackup_state"
+#define STATE_MAGIC "ABWSTATE"
+#define STATE_FORMAT_VERSION 2
+#define JOURNAL_FILE ".autobackup_journal"
+#define IGNORE_FILE ".autobackupignore"  // gitignore-style patterns, per root
+#define JOURNAL_COMPACT_MIN 4096  // Journal records before compaction is considered
+#define PRUNE_INTERVAL 600        // Seconds between retention passes
+#define SYNC_INTERVAL_MS 1000     // Default --sync-interval, see journal_commit()
+
+// Content hash algorithms; the value is recorded per file in the state
+typedef enum {
+    HASH_SHA256 = 0,    // Cryptographic, the default
+    HASH_BLAKE2B,       // BLAKE2b-512 truncated to 256 bits, faster without SHA-NI
+    HASH_XXH3,          // XXH3-128, non-cryptographic, needs HAVE_XXHASH
+    HASH_ALGO_COUNT
+} HashAlgo;
+
+const char *hash_algo_names[HASH_ALGO_COUNT] = { "sha256", "blake2b", "xxh3" };
+const int hash_algo_lengths[HASH_ALGO_COUNT] = { 32, 32, 16 };  // Significant bytes
+
+// Streaming hasher over any HashAlgo
+typedef struct {
+    HashAlgo algo;
+    EVP_MD_CTX *md;
+#ifdef HAVE_XXHASH
+    XXH3_state_t *xxh;
+#endif
+} Hasher;
+
+// Compression codecs for plain backups. Each writes its standard frame
+// format (zstd or LZ4 frame), whose magic number records the codec, and
+// the backup file name gets the matching suffix.
+typedef enum {
+    CODEC_NONE = 0,
+    CODEC_ZSTD,         // needs HAVE_ZSTD
+    CODEC_LZ4,          // needs HAVE_LZ4
+    CODEC_COUNT
+} Codec;
+
+const char *codec_names[CODEC_COUNT] = { "none", "zstd", "lz4" };
+const char *codec_suffixes[CODEC_COUNT] = { "", ".zst", ".lz4" };
+// First bytes of a zstd / LZ4 frame (little-endian 0xFD2FB528, 0x184D2204)
+const unsigned char codec_magics[CODEC_COUNT][4] = {
+    { 0 }, { 0x28, 0xB5, 0x2F, 0xFD }, { 0x04, 0x22, 0x4D, 0x18 }
+};
+const int codec_default_levels[CODEC_COUNT] = { 0, 3, 0 };
+
+// Streaming compressor writing frames to fd; CODEC_NONE writes through
+typedef struct {
+    Codec codec;
+    int fd;
+    char *out;
+    size_t out_size;
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zstd;
+#endif
+#ifdef HAVE_LZ4
+    LZ4F_cctx *lz4;
+#endif
+} Compressor;
 
 // Structure to track file state
 typedef struct {
-    char filename[MAX_PATH];
-    char hash[HASH_SIZE];
-    time_t last_modified;
+    const char *filename;  // Interned in the name pool, never freed
+    unsigned char hash[HASH_LEN];
+    unsigned char hash_algo;  // HashAlgo that produced hash
     int version;
+    // Stat signature of the content that was hashed; a file whose current
+    // stat matches all of it is assumed unchanged and not re-hashed
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint64_t size;
+    uint64_t inode;
+    int pending;              // Slot in the pending heap + 1, 0 if none
+    int64_t last_backup_ns;   // Monotonic time of the last backup, 0 if none
+    int poll_level;           // Polled every poll_interval << poll_level
+    int64_t next_poll_ns;     // Monotonic time of the next poll, 0 = now
+    uint64_t sample;          // Sampled fingerprint of a large file, 0 if none
+    int in_flight;            // A backup of it is queued or being written
+    int recheck;              // Changed again while in flight
 } FileState;
 
-// Global file tracking
-FileState tracked_files[MAX_FILES];
-int file_count = 0;
-char watch_directory[MAX_PATH];
-char backup_directory[MAX_PATH];
+// A changed file waiting for its quiet period or rate limit to pass.
+// The stat seen last is kept so a file that keeps changing starts over.
+typedef struct {
+    int index;                // Into tracked_files
+    int64_t due;              // Monotonic ns at which to check it
+    int64_t stable_since;     // When the file was first seen as below
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint64_t size;
+} PendingCheck;
+
+// Binary state snapshot layout (native byte order):
+//   StateHeader | StateRecord[record_count] | string table
+// Names in the string table are NUL-terminated, so a mapped snapshot's
+// names are used in place as FileState filenames.
+typedef struct {
+    char magic[8];              // STATE_MAGIC, not NUL-terminated
+    uint32_t format_version;    // STATE_FORMAT_VERSION
+    uint32_t record_size;       // sizeof(StateRecord)
+    uint64_t record_count;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+} StateHeader;
+
+typedef struct {
+    uint64_t name_offset;       // Into the string table
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint64_t size;
+    uint64_t inode;
+    int32_t version;
+    uint8_t hash_algo;
+    uint8_t reserved[3];
+    unsigned char hash[HASH_LEN];
+} StateRecord;
+
+// Format version 1 record: mtime in whole seconds, no other stat fields
+typedef struct {
+    uint64_t name_offset;
+    int64_t last_modified;
+    int32_t version;
+    uint8_t hash_algo;
+    uint8_t reserved[3];
+    unsigned char hash[HASH_LEN];
+} StateRecordV1;
+
+// Chunk of the append-only string pool holding tracked filenames
+typedef struct NameChunk {
+    struct NameChunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+} NameChunk;
+
+// Slot in the open-addressing index from filename to tracked_files position
+typedef struct {
+    uint32_t hash;
+    int index;      // -1 marks an empty slot
+} IndexSlot;
+
+// One compiled ignore pattern. Patterns without wildcards, or with a
+// single '*' at one end, are matched by the fast kinds without the glob
+// matcher.
+typedef enum {
+    IGNORE_LITERAL,     // "name": whole string
+    IGNORE_SUFFIX,      // "*.ext": literal tail
+    IGNORE_PREFIX,      // "name*": literal head
+    IGNORE_GLOB         // Anything else, through glob_match()
+} IgnoreKind;
+
+typedef struct {
+    char *pattern;      // Without '!', the leading '/' and a trailing '/'
+    size_t length;      // Of the literal part (fast kinds)
+    IgnoreKind kind;
+    int negate;         // "!pattern": include what earlier rules excluded
+    int dir_only;       // "pattern/": directories only
+    int anchored;       // Has a '/': matched against the whole relative path,
+                        // otherwise against the last component
+} IgnoreRule;
+
+typedef struct {
+    IgnoreRule *rules;  // In file order; the last match decides
+    size_t count;
+    size_t capacity;
+} IgnoreRules;
+
+// A version index line held back until the backup it names is synced
+typedef struct {
+    char *name;             // Tracked file name
+    char *location;         // Relative to backup_directory
+    int version;
+    time_t time;
+    unsigned char hash[HASH_LEN];
+    long long size;
+} HeldVersion;
+
+// A watched directory with its own file table, backup tree, journal and
+// pending checks. Threads, the inotify descriptor and the backup writers
+// are shared by all roots.
+typedef struct {
+    char watch_directory[MAX_PATH];
+    char backup_directory[MAX_PATH];
+    char staging_directory[MAX_PATH];
+    int watch_fd;               // watch_directory, for *at() calls
+    FileState *tracked_files;
+    int file_count;
+    int file_capacity;
+    IndexSlot *file_index;
+    size_t index_capacity;      // Always a power of two
+    // Append-only state journal, folded into the snapshot by compact_state()
+    FILE *journal;
+    int journal_entries;        // Records in the journal since the last snapshot
+    int journal_dirty;          // Records not yet committed
+    char *journal_buffer;       // Records held back until journal_commit()
+    size_t journal_length;
+    size_t journal_capacity;
+    int unsynced_backups;       // Backups written since the last sync_backups()
+    int64_t synced_ns;          // When sync_backups() last synced
+    HeldVersion *held_versions; // Index lines for sync_backups(), under held_lock
+    size_t held_count;
+    size_t held_capacity;
+    PendingCheck *pending;
+    size_t pending_count;
+    size_t pending_capacity;
+    int *recheck_list;          // Files that changed while in flight
+    size_t recheck_count;
+    size_t recheck_capacity;
+    IgnoreRules ignore;         // --exclude patterns, then IGNORE_FILE
+    int watch_failed;           // Not fully watched, so polled instead (see poll_root())
+} Root;
+
+// File discovered by the tree walker that is not tracked yet
+typedef struct {
+    char *name;     // Path relative to watch_directory
+    struct stat st;
+} FoundFile;
+
+// Shared directory queue for the parallel tree walker
+typedef struct {
+    Root *root;
+    int root_fd;
+    char **dirs;    // Pending directories, relative to root_fd
+    size_t count;
+    size_t capacity;
+    int active;     // Workers currently reading a directory
+    int failed;     // Ran out of memory, the walk is incomplete
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} WalkQueue;
+
+// Per-thread walker state; results are merged once the walk finishes
+typedef struct {
+    WalkQueue *queue;
+    FoundFile *found;
+    size_t count;
+    size_t capacity;
+    pthread_t thread;
+} WalkWorker;
+
+// One file to hash in a parallel batch
+typedef struct {
+    int index;              // Position in tracked_files, or -1 for a new file
+    const char *name;       // Path relative to watch_directory
+    struct stat st;
+    HashAlgo algo;          // Algorithm of the stored hash being compared
+    unsigned char hash[HASH_LEN];       // Content hash with the configured algorithm
+    unsigned char prev_hash[HASH_LEN];  // Same content hashed with algo
+    char *staged;           // Single-pass copy of the content, or NULL
+    long long staged_size;  // Bytes of content in staged, before compression
+    int status;             // Result of calculate_hash
+    int sample_first;       // Same size as before: try the sampled fingerprint
+    int skip;               // Sample matched, content taken as unchanged
+    uint64_t prev_sample;   // Fingerprint recorded for the old content
+    uint64_t sample;        // Fingerprint of the content now, 0 if none
+} HashJob;
+
+// A backup handed from the detector to the writer threads. The table
+// entry is updated when it is queued; before keeps the old one, put back
+// if the backup fails. Only the detector thread touches the table.
+typedef struct {
+    Root *root;             // Where job.index points
+    HashJob job;            // Owns job.staged
+    int version;
+    int failed;
+    FileState before;
+} BackupTask;
+
+// Bounded lock-free queue of pointers for any number of producers and
+// consumers (Vyukov's sequence-numbered ring). Each cell's sequence says
+// whether it is free for the push at that position or holds the item for
+// the pop there.
+typedef struct {
+    _Atomic size_t sequence;
+    void *item;
+} RingCell;
+
+typedef struct {
+    RingCell *cells;
+    size_t mask;               // Capacity - 1
+    _Atomic size_t head;       // Next position to push
+    _Atomic size_t tail;       // Next position to pop
+} TaskRing;
+
+// Token bucket for --io-limit and --iops-limit. Callers take what they
+// used and may drive tokens negative; the debt is slept off, so large
+// reads are paced rather than refused.
+typedef struct {
+    double rate;            // Tokens per second, 0 for no limit
+    double tokens;
+    int64_t refilled_ns;    // Monotonic time tokens was last topped up
+} TokenBucket;
+
+// Page cache residency of a file before we read it, so --drop-cache can
+// drop the pages our reads brought in and keep the ones already cached
+typedef struct {
+    unsigned char *resident;    // One byte per page, NULL if unknown
+    size_t pages;
+} CacheMap;
+
+// Latency histogram; buckets[i] counts observations up to
+// histogram_bounds[i] seconds (not cumulative), the last one the rest
+typedef struct {
+    _Atomic uint64_t buckets[HISTOGRAM_BUCKETS + 1];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum_ns;
+} Histogram;
+
+// Counters and gauges for --metrics and --stats-interval. Updated with
+// relaxed atomics from any thread; gauges are set by the detector.
+typedef struct {
+    _Atomic uint64_t files_statted;
+    _Atomic uint64_t hashes;            // Full content hashes computed
+    _Atomic uint64_t bytes_read;        // Read to hash or fingerprint files
+    _Atomic uint64_t backups;
+    _Atomic uint64_t backup_failures;
+    _Atomic uint64_t backup_bytes;      // Content bytes of stored backups
+    _Atomic uint64_t syncs;             // sync_backups() calls that synced
+    _Atomic uint64_t events;            // inotify events received
+    _Atomic uint64_t events_dropped;    // inotify queue overflows
+    _Atomic uint64_t checks_deferred;   // By --debounce or --rate-limit
+    _Atomic int64_t tracked_files;
+    _Atomic int64_t pending_checks;
+    _Atomic int64_t queue_depth;        // Backups queued or being written
+    Histogram scan_duration;            // walk_tree()
+    Histogram check_duration;           // check_files()
+    Histogram backup_duration;          // commit_backup()
+} Metrics;
+
+#define METRIC_ADD(field, n) \
+    atomic_fetch_add_explicit(&metrics.field, (n), memory_order_relaxed)
+#define METRIC_SET(field, v) \
+    atomic_store_explicit(&metrics.field, (v), memory_order_relaxed)
+#define METRIC_GET(field) atomic_load_explicit(&metrics.field, memory_order_relaxed)
+
+// Shared cursor over a batch of hash jobs
+typedef struct {
+    Root *root;
+    HashJob *jobs;
+    size_t count;
+    size_t next;
+    pthread_mutex_t lock;
+} HashBatch;
+
+#ifdef HAVE_IO_URING
+// io_uring instance mapped by uring_init()
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned tail;          // Local submission tail, published on submit
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+} Uring;
+
+// A file being hashed by uring_hash_jobs(), one read in flight
+typedef struct {
+    HashJob *job;           // NULL while the slot is free
+    int fd;
+    off_t offset;
+    int need_prev;          // Also hashing with job->algo
+    Hasher hasher, prev_hasher;
+    unsigned char *buffer;
+    CacheMap cache;         // For --drop-cache
+} UringRead;
+#endif
+
+// One line of a version index, as seen by the pruner and --log/--restore
+typedef struct {
+    int version;
+    time_t time;
+    long long size;
+    const char *hash;       // Hex content hash, points into the line
+    const char *location;   // Points into the line it was parsed from
+    size_t file;            // Index file it came from
+    int keep;
+} VersionRecord;
+
+// Set of store locations (open addressing, power-of-two capacity)
+typedef struct {
+    char **slots;
+    size_t count;
+    size_t capacity;
+} LocationSet;
+
+// Copy mechanisms, cleared once the backup filesystem rejects them
+// (by whichever writer thread finds out first)
+_Atomic int reflink_supported = 1;
+_Atomic int copy_range_supported = 1;
+_Atomic int sendfile_supported = 1;
+
+// Manifest built up while a file is being chunked
+typedef struct {
+    char *manifest;         // "<chunk hash> <length>\n" lines
+    size_t length;
+    size_t capacity;
+    size_t chunks;
+    size_t new_chunks;      // Chunks that were not in the store yet
+    long long new_bytes;
+} ChunkList;
+
+// Global file tracking. root is the directory the calling thread is
+// working on; the detector switches it as it visits each of roots.
+Root *roots = NULL;
+int root_count = 0;
+__thread Root *root = NULL;
+NameChunk *name_pool = NULL;
+int single_pass = 0;
+int dedup = 0;
+int chunked = 0;
+uint64_t gear_table[256];
+
+int inotify_fd = -1;
+int recursive = 0;
+
+// Filtering on top of the hidden-file rule: --exclude patterns (applied
+// before each root's IGNORE_FILE) and --max-file-size
+char **exclude_patterns = NULL;
+int exclude_count = 0;
+long long max_file_size = 0;    // 0 for no limit
+int worker_threads = 1;
+HashAlgo hash_algo = HASH_SHA256;
+Codec compress_codec = CODEC_NONE;
+int compress_level = 0;
+
+// Retention policy (all zero: keep everything). store_lock is held shared
+// while a backup is stored and recorded (writers run side by side), and
+// exclusively by the pruner while it edits an index or removes an object.
+int keep_last = 0;
+int keep_hourly = 0;
+int keep_daily = 0;
+int keep_weekly = 0;
+long long max_backup_bytes = 0;
+int prune_enabled = 0;
+pthread_rwlock_t store_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t held_lock = PTHREAD_MUTEX_INITIALIZER;  // Every root's held_versions
+
+// I/O engine
+int use_uring = 0;
+int sample_large = 0;
+
+// I/O impact limits shared by hashing and backups: byte and operation
+// budgets, the idle I/O class, and dropping pages we cached ourselves
+long long io_limit = 0;         // Bytes per second, 0 for no limit
+int iops_limit = 0;
+int io_idle = 0;
+int drop_cache = 0;
+TokenBucket io_bytes_bucket;
+TokenBucket io_ops_bucket;
+pthread_mutex_t throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+#ifdef HAVE_IO_URING
+Uring io_ring;
+#endif
+
+// Polling schedule: unchanged files back off from poll_interval up to
+// max_poll_interval seconds
+int poll_interval = 5;
+int max_poll_interval = 0;
+
+// Debounce and rate limiting; pending checks form a min-heap on due time
+int debounce_ms = 0;
+int rate_limit_seconds = 0;
+int sync_interval_ms = SYNC_INTERVAL_MS;  // Least time between backup syncs
+volatile sig_atomic_t stop_requested = 0;   // SIGINT/SIGTERM seen, see stop_watching()
+
+// Backup writers. The detector pushes tasks onto small_backups or
+// large_backups and blocks while the ring is full; writers report back
+// through finished_backups and a byte on wake_pipe. Sleeping writers and
+// a waiting detector are woken through queue_lock.
+int writer_count = 2;
+TaskRing small_backups;
+TaskRing large_backups;
+TaskRing finished_backups;
+int wake_pipe[2] = { -1, -1 };
+int backups_in_flight = 0;      // Queued or being written, detector only
+pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queue_work = PTHREAD_COND_INITIALIZER;
+pthread_cond_t queue_space = PTHREAD_COND_INITIALIZER;
+_Atomic int idle_writers = 0;
+_Atomic int detector_waiting = 0;
+
+// Metrics, served over HTTP by --metrics and summarized every
+// --stats-interval seconds
+Metrics metrics;
+const double histogram_bounds[HISTOGRAM_BUCKETS] = {
+    0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10, 60
+};
+const char *metrics_address = NULL;
+int metrics_fd = -1;
+int stats_interval = 0;
+
+// --bench: generated tree shape, and commit_backup() timings while it runs
+int bench_files = 10000;
+long long bench_size = 16 * 1024;
+int bench_change = 10;
+int64_t *bench_latencies = NULL;
+size_t bench_latency_capacity = 0;
+_Atomic size_t bench_latency_count = 0;
+_Atomic long long bench_bytes_copied = 0;
+
+// Root and relative directory for each inotify watch descriptor
+char **watch_paths = NULL;
+Root **watch_roots = NULL;
+int watch_path_count = 0;
+pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function prototypes
+int hasher_init(Hasher *h, HashAlgo algo);
+void hasher_update(Hasher *h, const void *data, size_t len);
+void hasher_final(Hasher *h, unsigned char *output_hash);
+int calculate_hash(const char *filepath, HashAlgo algo, unsigned char *output_hash);
+int hash_fd_large(int fd, Hasher *hasher);
+int parse_hash_algo(const char *name);
+void hash_to_hex(const unsigned char *hash, char *hex);
+int hex_to_hash(const char *hex, unsigned char *hash);
+const char *intern_name(const char *name);
+FileState *append_file(const char *name);
+FileState *append_entry(const char *stable_name);
+void set_signature(FileState *fs, const struct stat *st);
+int signature_matches(const FileState *fs, const struct stat *st);
+void reserve_files(int count);
+int scan_directory();
+void check_for_changes();
+void poll_for_changes();
+void update_poll_schedule(FileState *fs, int changed);
+void check_files(int *indices, size_t count, int force);
+int64_t monotonic_ns();
+int defer_check(int index, const struct stat *st);
+void pending_sift(size_t slot);
+void pending_remove(size_t slot);
+int next_due_timeout();
+void run_due_checks();
+void track_files(FoundFile *found, size_t count);
+void hash_jobs(HashJob *jobs, size_t count);
+void hash_jobs_threaded(HashJob *jobs, size_t count);
+void stat_jobs(HashJob *jobs, size_t count);
+uint64_t sample_fingerprint(const char *name, off_t size);
+#ifdef HAVE_IO_URING
+int uring_init(Uring *ring, unsigned entries);
+void uring_exit(Uring *ring);
+int uring_submit(Uring *ring, unsigned wait_nr);
+int uring_stat_jobs(HashJob *jobs, size_t count);
+int uring_hash_jobs(HashJob *jobs, size_t count);
+#endif
+void *hash_worker(void *arg);
+int find_file(const char *filename);
+uint32_t hash_name(const char *name);
+void index_insert(int index);
+void rebuild_index(size_t capacity);
+int init_watcher();
+void add_watch(const char *dir);
+int walk_tree(const char *start);
+void *walk_worker(void *arg);
+void walk_directory(WalkWorker *worker, char *dir);
+int make_dirs(const char *path);
+int format_path(char *out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+int default_threads();
+void flush_events(int *changed, size_t *changed_count, FoundFile *found, size_t *found_count);
+int process_events();
+void watch_events();
+void poll_root(Root *r);
+int create_backup(const char *name, int version, char *backup_path, long long *size);
+int copy_to_path(const char *src_path, const char *dest, Codec codec, long long *copied);
+int parse_codec(const char *spec, int *level);
+int compressor_init(Compressor *c, Codec codec, int level, int fd);
+int compressor_write(Compressor *c, const void *data, size_t len);
+int compressor_finish(Compressor *c);
+int compress_file_data(int src_fd, int dst_fd, Codec codec, long long *copied);
+int decompress_file_data(int src_fd, int dst_fd, Codec codec);
+int commit_backup(HashJob *job, int version);
+void record_backup(FileState *fs, const HashJob *job);
+int ring_init(TaskRing *ring, size_t capacity);
+int ring_push(TaskRing *ring, void *item);
+void *ring_pop(TaskRing *ring);
+int start_writers();
+int queue_backup(HashJob *job, FileState *fs);
+BackupTask *next_backup_task(unsigned *turn);
+void *backup_writer(void *arg);
+void reap_backups();
+void finish_backups();
+void install_stop_handler();
+void stop_watching();
+int store_object(HashJob *job, char *location, unsigned char *stored_hash, int *existed);
+void object_location(const char *store, const unsigned char *hash, HashAlgo algo,
+                     char *location);
+int write_object(const char *store, const void *data, size_t len,
+                 const unsigned char *hash, int *existed);
+int store_chunked(HashJob *job, int version, char *location, unsigned char *stored_hash,
+                  int *existed);
+int emit_chunk(ChunkList *list, const unsigned char *chunk, size_t len);
+void init_gear_table();
+int append_version(const char *name, int version, time_t when, const unsigned char *hash,
+                   off_t size, const char *location);
+int hold_version(const char *name, int version, const unsigned char *hash,
+                 off_t size, const char *location);
+int backup_path_for(const char *name, int version, char *backup_path);
+int publish_backup(const char *staged, const char *name, int version, char *backup_path);
+int hash_and_stage(HashJob *job);
+void clean_staging();
+int object_exists(const char *path);
+long long parse_size(const char *text);
+int location_set_add(LocationSet *set, const char *location);
+int location_set_has(const LocationSet *set, const char *location);
+void location_set_free(LocationSet *set);
+int collect_index_files(const char *dir, char ***list, size_t *count, size_t *capacity);
+int parse_version_line(char *line, VersionRecord *record);
+void keep_buckets(VersionRecord *records, size_t count, int buckets, const char *format);
+void apply_retention(VersionRecord *records, size_t count);
+int rewrite_index(const char *index_name, const int *drop, size_t drop_count);
+long long collect_garbage(time_t gc_start, char **index_files, size_t index_count);
+void prune_backups();
+int parse_backup_name(const char *filename, char *original, int *version, time_t *when);
+int migrate_backup(const char *location, const char *name, char *new_location);
+size_t migrate_directory(const char *dir);
+int migrate_layout();
+int parse_point(const char *spec, time_t *at, int *version);
+ssize_t load_versions(const char *name, char **text, VersionRecord **records);
+ssize_t pick_version(const VersionRecord *records, size_t count, time_t at, int version);
+int backup_codec(const char *name, const char *location, int fd);
+int restore_content(const char *name, const VersionRecord *record, int dst_fd);
+int restore_file(const char *name, const VersionRecord *record, const char *target_dir);
+int run_query(char **files, int file_count, int restore, int list_all,
+              time_t at, int version, const char *target_dir);
+void *prune_worker(void *arg);
+int copy_file_data(int src_fd, int dst_fd);
+int append_file_data(int src_fd, int dst_fd);
+int write_all(int fd, const void *data, size_t len);
+int send_all(int sock, const void *data, size_t len);
+void throttle_io(size_t bytes, int ops);
+int write_throttled(int fd, const void *data, size_t len);
+void set_idle_io();
+void cache_map(int fd, CacheMap *map);
+void cache_drop(int fd, CacheMap *map);
+void drop_written(int fd);
+int stat_at(int dir_fd, const char *name, struct stat *st);
+int get_file_version(const char *filename);
+void load_state();
+int save_state();
+int format_entry(char *line, size_t size, const FileState *fs);
+int apply_entry(char *line);
+int load_binary_state(const char *path);
+void load_text_state(FILE *f);
+void open_journal();
+void journal_entry(const FileState *fs);
+void journal_commit();
+int sync_backups();
+void compact_state();
+int glob_match(const char *pattern, const char *text);
+int add_ignore_rule(IgnoreRules *rules, const char *line);
+int load_ignore_rules();
+int ignored(const char *path, int is_dir);
+void forget_ignored_files();
+void create_backup_dir();
+char* get_timestamp();
+void print_status();
+int add_root(const char *dir);
+int load_config(const char *path);
+int open_root();
+int load_root();
+void histogram_observe(Histogram *h, int64_t ns);
+void update_gauges();
+int metrics_listen(const char *address);
+void write_histogram(FILE *f, const char *name, const char *help, Histogram *h);
+void write_metrics(FILE *f);
+void serve_metrics(int client);
+void *metrics_worker(void *arg);
+void *stats_worker(void *arg);
+uint64_t bench_random(uint64_t *state);
+int bench_write_file(const char *path, off_t size, const unsigned char *block);
+void bench_wait_writers();
+int run_benchmark();
+int remove_tree(const char *path);
+int run_self_test();
+
+// Look up a HashAlgo by name, returns -1 if unknown or not compiled in
+int parse_hash_algo(const char *name) {
+    for (int i = 0; i < HASH_ALGO_COUNT; i++) {
+        if (strcmp(name, hash_algo_names[i]) == 0) {
+#ifndef HAVE_XXHASH
+            if (i == HASH_XXH3) return -1;
+#endif
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Start a streaming hash, returns -1 if the algorithm is unavailable
+int hasher_init(Hasher *h, HashAlgo algo) {
+    memset(h, 0, sizeof(*h));
+    h->algo = algo;
+    
+    if (algo == HASH_XXH3) {
+#ifdef HAVE_XXHASH
+        h->xxh = XXH3_createState();
+        if (!h->xxh) return -1;
+        XXH3_128bits_reset(h->xxh);
+        return 0;
+#else
+        return -1;
+#endif
+    }
+    
+    // SHA-256 and BLAKE2b go through OpenSSL (Modern OpenSSL 3.0+ way)
+    h->md = EVP_MD_CTX_new();
+    if (!h->md) return -1;
+    const EVP_MD *md = algo == HASH_BLAKE2B ? EVP_blake2b512() : EVP_sha256();
+    if (EVP_DigestInit_ex(h->md, md, NULL) != 1) {
+        EVP_MD_CTX_free(h->md);
+        return -1;
+    }
+    return 0;
+}
+
+void hasher_update(Hasher *h, const void *data, size_t len) {
+#ifdef HAVE_XXHASH
+    if (h->xxh) {
+        XXH3_128bits_update(h->xxh, data, len);
+        return;
+    }
+#endif
+    EVP_DigestUpdate(h->md, data, len);
+}
+
+// Finish the hash, writing HASH_LEN bytes, and release the hasher
+void hasher_final(Hasher *h, unsigned char *output_hash) {
+    memset(output_hash, 0, HASH_LEN);
+#ifdef HAVE_XXHASH
+    if (h->xxh) {
+        XXH128_canonical_t canonical;
+        XXH128_canonicalFromHash(&canonical, XXH3_128bits_digest(h->xxh));
+        memcpy(output_hash, canonical.digest, sizeof(canonical.digest));
+        XXH3_freeState(h->xxh);
+        return;
+    }
+#endif
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    EVP_DigestFinal_ex(h->md, hash, NULL);
+    EVP_MD_CTX_free(h->md);
+    memcpy(output_hash, hash, HASH_LEN);
+}
+
+// Feed a whole file to the hasher with large aligned reads, telling the
+// kernel to read ahead aggressively. Returns 0 on success, -1 on error.
+int hash_fd_large(int fd, Hasher *hasher) {
+    void *buffer;
+    if (posix_memalign(&buffer, 4096, LARGE_READ_SIZE) != 0) {
+        return -1;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    
+    ssize_t bytes;
+    while ((bytes = read(fd, buffer, LARGE_READ_SIZE)) != 0) {
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            free(buffer);
+            return -1;
+        }
+        throttle_io((size_t)bytes, 1);
+        hasher_update(hasher, buffer, (size_t)bytes);
+    }
+    
+    free(buffer);
+    return 0;
+}
+
+// Calculate the content hash of a file with the given algorithm.
+// Writes HASH_LEN raw bytes, returns 0 on success or -1 if unreadable.
+// Small files use a plain buffered read; large ones go through
+// hash_fd_large() to cut the syscall count by two orders of magnitude.
+// (mmap is deliberately avoided: a watched file truncated mid-hash
+// would raise SIGBUS.)
+int calculate_hash(const char *filepath, HashAlgo algo, unsigned char *output_hash) {
+    FILE *file = fopen(filepath, "rb");
+    if (!file) {
+        return -1;
+    }
+
+    Hasher hasher;
+    if (hasher_init(&hasher, algo) != 0) {
+        fclose(file);
+        return -1;
+    }
+
+    int failed;
+    struct stat st = {0};
+    CacheMap cache;
+    cache_map(fileno(file), &cache);
+    if (fstat(fileno(file), &st) == 0 && st.st_size >= LARGE_FILE_THRESHOLD) {
+        failed = hash_fd_large(fileno(file), &hasher);
+    } else {
+        unsigned char buffer[8192];
+        size_t bytes;
+        
+        throttle_io((size_t)st.st_size, 1);
+        while ((bytes = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+            hasher_update(&hasher, buffer, bytes);
+        }
+        failed = ferror(file);
+    }
+
+    unsigned char hash[HASH_LEN];
+    hasher_final(&hasher, hash);
+
+    cache_drop(fileno(file), &cache);
+    fclose(file);
+    if (failed) {
+        return -1;
+    }
+    memcpy(output_hash, hash, HASH_LEN);
+    return 0;
+}
+
+// Format a raw hash as a lowercase hex string (HASH_SIZE bytes incl. null)
+void hash_to_hex(const unsigned char *hash, char *hex) {
+    for (int i = 0; i < HASH_LEN; i++) {
+        sprintf(hex + (i * 2), "%02x", hash[i]);
+    }
+    hex[HASH_LEN * 2] = '\0';
+}
+
+// Parse a hex string into a raw hash, returns -1 if it is malformed
+int hex_to_hash(const char *hex, unsigned char *hash) {
+    for (int i = 0; i < HASH_LEN; i++) {
+        unsigned int byte;
+        if (sscanf(hex + (i * 2), "%2x", &byte) != 1) {
+            return -1;
+        }
+        hash[i] = (unsigned char)byte;
+    }
+    return 0;
+}
+
+// Copy a filename into the string pool; the result lives until exit
+const char *intern_name(const char *name) {
+    size_t len = strlen(name) + 1;
+    
+    if (!name_pool || name_pool->size - name_pool->used < len) {
+        size_t size = len > NAME_POOL_CHUNK ? len : NAME_POOL_CHUNK;
+        NameChunk *chunk = malloc(sizeof(NameChunk) + size);
+        if (!chunk) {
+            fprintf(stderr, "[ERROR] Out of memory interning filename\n");
+            exit(1);
+        }
+        chunk->next = name_pool;
+        chunk->used = 0;
+        chunk->size = size;
+        name_pool = chunk;
+    }
+    
+    char *copy = name_pool->data + name_pool->used;
+    memcpy(copy, name, len);
+    name_pool->used += len;
+    return copy;
+}
+
+// Append a new entry whose name stays valid until exit (interned or in
+// the mapped snapshot) and index it by name.
+// Pointers into tracked_files are invalidated when the table grows.
+FileState *append_entry(const char *stable_name) {
+    if (root->file_count == root->file_capacity) {
+        int capacity = root->file_capacity ? root->file_capacity * 2 : 256;
+        FileState *files = realloc(root->tracked_files, capacity * sizeof(FileState));
+        if (!files) {
+            fprintf(stderr, "[ERROR] Out of memory growing file table\n");
+            exit(1);
+        }
+        root->tracked_files = files;
+        root->file_capacity = capacity;
+    }
+    
+    FileState *fs = &root->tracked_files[root->file_count];
+    memset(fs, 0, sizeof(*fs));
+    fs->filename = stable_name;
+    index_insert(root->file_count);
+    root->file_count++;
+    return fs;
+}
+
+// Append a new entry, copying its name into the string pool
+FileState *append_file(const char *name) {
+    return append_entry(intern_name(name));
+}
+
+// Remember the stat signature of the content just hashed
+void set_signature(FileState *fs, const struct stat *st) {
+    fs->mtime_ns = TIMESPEC_NS(ST_MTIM(st));
+    fs->ctime_ns = TIMESPEC_NS(ST_CTIM(st));
+    fs->size = (uint64_t)st->st_size;
+    fs->inode = (uint64_t)st->st_ino;
+}
+
+// Does the file still look exactly like when it was last hashed? Any
+// write updates mtime and ctime with nanosecond resolution, and a file
+// replaced by rename gets a new inode.
+int signature_matches(const FileState *fs, const struct stat *st) {
+    return fs->mtime_ns == TIMESPEC_NS(ST_MTIM(st)) &&
+           fs->ctime_ns == TIMESPEC_NS(ST_CTIM(st)) &&
+           fs->size == (uint64_t)st->st_size &&
+           fs->inode == (uint64_t)st->st_ino;
+}
+
+// Make room for count entries in the table and its index up front
+void reserve_files(int count) {
+    if (count > root->file_capacity) {
+        FileState *files = realloc(root->tracked_files, count * sizeof(FileState));
+        if (!files) {
+            fprintf(stderr, "[ERROR] Out of memory growing file table\n");
+            exit(1);
+        }
+        root->tracked_files = files;
+        root->file_capacity = count;
+    }
+    if ((size_t)count * 2 > root->index_capacity) {
+        rebuild_index((size_t)count * 2);
+    }
+}
+
+// Match text against a gitignore-style glob: '*' and '?' do not match
+// '/', "[...]" is a character class, "**/" matches any number of leading
+// directories and a trailing "**" everything below. Returns 1 on a match.
+int glob_match(const char *p, const char *s) {
+    while (*p) {
+        if (p[0] == '*' && p[1] == '*') {
+            p += 2;
+            if (*p == '/') {
+                p++;
+                for (const char *t = s; ; t++) {
+                    if (glob_match(p, t)) return 1;
+                    t = strchr(t, '/');
+                    if (!t) return 0;
+                }
+            }
+            for (const char *t = s; ; t++) {
+                if (glob_match(p, t)) return 1;
+                if (!*t) return 0;
+            }
+        }
+        if (*p == '*') {
+            p++;
+            for (const char *t = s; ; t++) {
+                if (glob_match(p, t)) return 1;
+                if (!*t || *t == '/') return 0;
+            }
+        }
+        if (!*s) {
+            return 0;
+        }
+        if (*p == '?') {
+            if (*s == '/') return 0;
+            p++;
+            s++;
+            continue;
+        }
+        if (*p == '[') {
+            // A ']' right after "[" or "[!" is a member, not the end; with
+            // no closing ']' the '[' is an ordinary character
+            const char *c = p + 1;
+            int negate = *c == '!' || *c == '^';
+            if (negate) c++;
+            const char *end = strchr(*c == ']' ? c + 1 : c, ']');
+            if (end) {
+                if (*s == '/') return 0;
+                int found = 0;
+                while (c < end) {
+                    if (c + 2 < end && c[1] == '-') {
+                        found |= (unsigned char)*s >= (unsigned char)c[0] &&
+                                 (unsigned char)*s <= (unsigned char)c[2];
+                        c += 3;
+                    } else {
+                        found |= *c == *s;
+                        c++;
+                    }
+                }
+                if (found == negate) return 0;
+                p = end + 1;
+                s++;
+                continue;
+            }
+        }
+        if (*p == '\\' && p[1]) p++;
+        if (*p != *s) return 0;
+        p++;
+        s++;
+    }
+    return *s == '\0';
+}
+
+// Compile one line of an ignore file (or an --exclude pattern) into rules.
+// Blank lines and '#' comments are skipped. Returns -1 if out of memory.
+int add_ignore_rule(IgnoreRules *rules, const char *line) {
+    IgnoreRule rule = {0};
+    size_t len = strlen(line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' ||
+                       (line[len - 1] == ' ' && (len < 2 || line[len - 2] != '\\')))) {
+        len--;
+    }
+    if (len == 0 || line[0] == '#') {
+        return 0;
+    }
+    if (line[0] == '!') {
+        rule.negate = 1;
+        line++;
+        len--;
+    } else if (line[0] == '\\' && (line[1] == '#' || line[1] == '!')) {
+        line++;
+        len--;
+    }
+    if (len > 0 && line[len - 1] == '/') {
+        rule.dir_only = 1;
+        len--;
+    }
+    if (len > 0 && line[0] == '/') {
+        rule.anchored = 1;
+        line++;
+        len--;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    rule.pattern = strndup(line, len);
+    if (!rule.pattern) {
+        return -1;
+    }
+    if (memchr(rule.pattern, '/', len)) rule.anchored = 1;
+    
+    // Classify: the fast kinds have no other wildcard, escape or '/'
+    // (a '*' must not cross directories). A suffix rule matches the last
+    // name at any depth, so anchored "*.ext" stays a glob on the path.
+    const char *special = "*?[\\";
+    size_t first = strcspn(rule.pattern, special);
+    rule.kind = IGNORE_GLOB;
+    if (first == len) {
+        rule.kind = IGNORE_LITERAL;
+        rule.length = len;
+    } else if (!rule.anchored && rule.pattern[0] == '*' && len > 1 &&
+               rule.pattern[1] != '*' && strcspn(rule.pattern + 1, special) == len - 1 &&
+               !strchr(rule.pattern + 1, '/')) {
+        rule.kind = IGNORE_SUFFIX;
+        rule.length = len - 1;
+    } else if (first == len - 1 && rule.pattern[first] == '*' &&
+               (first == 0 || rule.pattern[first - 1] != '*')) {
+        rule.kind = IGNORE_PREFIX;
+        rule.length = first;
+    }
+    
+    if (rules->count == rules->capacity) {
+        size_t capacity = rules->capacity ? rules->capacity * 2 : 16;
+        IgnoreRule *grown = realloc(rules->rules, capacity * sizeof(IgnoreRule));
+        if (!grown) {
+            free(rule.pattern);
+            return -1;
+        }
+        rules->rules = grown;
+        rules->capacity = capacity;
+    }
+    rules->rules[rules->count++] = rule;
+    return 0;
+}
+
+// Compile the current root's rules: the --exclude patterns, then its
+// IGNORE_FILE, so the file can re-include what the command line excludes.
+// Returns -1 if out of memory.
+int load_ignore_rules() {
+    for (int i = 0; i < exclude_count; i++) {
+        if (add_ignore_rule(&root->ignore, exclude_patterns[i]) != 0) return -1;
+    }
+    
+    char path[MAX_PATH];
+    FILE *f = format_path(path, "%s/%s", root->watch_directory, IGNORE_FILE) == 0
+                  ? fopen(path, "r") : NULL;
+    if (!f) {
+        return 0;
+    }
+    char line[MAX_PATH];
+    int status = 0;
+    while (status == 0 && fgets(line, sizeof(line), f)) {
+        status = add_ignore_rule(&root->ignore, line);
+    }
+    fclose(f);
+    if (root->ignore.count > 0) {
+        printf("[AutoBackup] Loaded %zu ignore rule(s) for %s\n", root->ignore.count,
+               root->watch_directory);
+    }
+    return status;
+}
+
+// Does rule match path (relative to watch_directory) or, for unanchored
+// rules, its last component name?
+static int rule_matches(const IgnoreRule *rule, const char *path, const char *name) {
+    const char *text = rule->anchored ? path : name;
+    size_t len;
+    switch (rule->kind) {
+    case IGNORE_LITERAL:
+        return strcmp(text, rule->pattern) == 0;
+    case IGNORE_SUFFIX:
+        len = strlen(text);
+        return len >= rule->length &&
+               memcmp(text + len - rule->length, rule->pattern + 1, rule->length) == 0;
+    case IGNORE_PREFIX:
+        return strncmp(text, rule->pattern, rule->length) == 0 && !strchr(text + rule->length, '/');
+    default:
+        return glob_match(rule->pattern, text);
+    }
+}
+
+// Is path (relative to watch_directory) excluded by the current root's
+// rules? Rules are tried from the last one back, so the first match
+// decides. Parent directories are not checked: the walker never enters
+// an excluded one, as with gitignore.
+int ignored(const char *path, int is_dir) {
+    if (root->ignore.count == 0) {
+        return 0;
+    }
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    for (size_t i = root->ignore.count; i-- > 0; ) {
+        const IgnoreRule *rule = &root->ignore.rules[i];
+        if ((rule->dir_only && !is_dir) || !rule_matches(rule, path, name)) {
+            continue;
+        }
+        return !rule->negate;
+    }
+    return 0;
+}
+
+// Is a tracked file excluded by the rules, itself or through one of its
+// directories? Used on files loaded from an earlier run's state.
+static int ignored_path(const char *path) {
+    char dir[MAX_PATH];
+    for (const char *slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/')) {
+        size_t len = (size_t)(slash - path);
+        if (len >= sizeof(dir)) break;
+        memcpy(dir, path, len);
+        dir[len] = '\0';
+        if (ignored(dir, 1)) return 1;
+    }
+    return ignored(path, 0);
+}
+
+// Stop tracking files loaded from the state that the current rules
+// exclude (their backups are kept). Runs at startup between load_state()
+// and open_journal(), while nothing refers to table positions.
+void forget_ignored_files() {
+    if (root->ignore.count == 0) {
+        return;
+    }
+    int kept = 0;
+    for (int i = 0; i < root->file_count; i++) {
+        if (!ignored_path(root->tracked_files[i].filename)) {
+            root->tracked_files[kept++] = root->tracked_files[i];
+        }
+    }
+    if (kept == root->file_count) {
+        return;
+    }
+    printf("[AutoBackup] No longer tracking %d ignored file(s)\n", root->file_count - kept);
+    root->file_count = kept;
+    rebuild_index(root->index_capacity);
+    root->journal_entries++;  // So open_journal() rewrites the snapshot
+}
+
+// FNV-1a hash of a filename
+uint32_t hash_name(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Add tracked_files[index] to the filename index, growing it past 50% load
+void index_insert(int index) {
+    if ((size_t)(root->file_count + 1) * 2 > root->index_capacity) {
+        rebuild_index(root->index_capacity ? root->index_capacity * 2 : 64);
+    }
+    
+    uint32_t h = hash_name(root->tracked_files[index].filename);
+    size_t mask = root->index_capacity - 1;
+    size_t slot = h & mask;
+    while (root->file_index[slot].index >= 0) {
+        slot = (slot + 1) & mask;
+    }
+    root->file_index[slot].hash = h;
+    root->file_index[slot].index = index;
+}
+
+// Reallocate the index with at least the given capacity (rounded up to a
+// power of two, and to at most 50% load) and re-insert every file
+void rebuild_index(size_t capacity) {
+    size_t wanted = capacity;
+    capacity = 64;
+    while (capacity < wanted || capacity < (size_t)root->file_count * 2 + 2) {
+        capacity *= 2;
+    }
+    
+    IndexSlot *slots = malloc(capacity * sizeof(IndexSlot));
+    if (!slots) {
+        fprintf(stderr, "[ERROR] Out of memory growing file index\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        slots[i].index = -1;
+    }
+    
+    free(root->file_index);
+    root->file_index = slots;
+    root->index_capacity = capacity;
+    
+    size_t mask = capacity - 1;
+    for (int i = 0; i < root->file_count; i++) {
+        uint32_t h = hash_name(root->tracked_files[i].filename);
+        size_t slot = h & mask;
+        while (root->file_index[slot].index >= 0) {
+            slot = (slot + 1) & mask;
+        }
+        root->file_index[slot].hash = h;
+        root->file_index[slot].index = i;
+    }
+}
+
+// Find a tracked file by name, returns its index or -1
+int find_file(const char *filename) {
+    if (root->index_capacity == 0) {
+        return -1;
+    }
+    
+    uint32_t h = hash_name(filename);
+    size_t mask = root->index_capacity - 1;
+    for (size_t slot = h & mask; root->file_index[slot].index >= 0; slot = (slot + 1) & mask) {
+        if (root->file_index[slot].hash == h &&
+            strcmp(root->tracked_files[root->file_index[slot].index].filename, filename) == 0) {
+            return root->file_index[slot].index;
+        }
+    }
+    return -1;
+}
+
+// Get current version number for a file
+int get_file_version(const char *filename) {
+    int i = find_file(filename);
+    return i >= 0 ? root->tracked_files[i].version : 0;
+}
+
+// Get formatted timestamp
+char* get_timestamp() {
+    static __thread char timestamp[32];  // Per thread, writers call this concurrently
+    time_t now = time(NULL);
+    struct tm t;
+    localtime_r(&now, &t);
+    strftime(timestamp, sizeof(timestamp), "%Y%m%d_%H%M%S", &t);
+    return timestamp;
+}
+
+// Create backup directory if it doesn't exist
+void create_backup_dir() {
+    struct stat st = {0};
+    if (stat(root->backup_directory, &st) == -1) {
+        mkdir(root->backup_directory, 0755);
+        printf("[AutoBackup] Created backup directory: %s\n", root->backup_directory);
+    }
+}
+
+// Format a path into a MAX_PATH buffer. Returns 0, or -1 with errno set
+// to ENAMETOOLONG if it does not fit, so an over-long path is rejected
+// rather than silently cut short.
+int format_path(char *out, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(out, MAX_PATH, format, args);
+    va_end(args);
+    if (len < 0 || len >= MAX_PATH) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+// Create every missing directory along path (like mkdir -p)
+int make_dirs(const char *path) {
+    char buffer[MAX_PATH];
+    strncpy(buffer, path, MAX_PATH - 1);
+    buffer[MAX_PATH - 1] = '\0';
+    
+    for (char *p = buffer + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            if (mkdir(buffer, 0755) != 0 && errno != EEXIST) return -1;
+            *p = '/';
+        }
+    }
+    if (mkdir(buffer, 0755) != 0 && errno != EEXIST) return -1;
+    return 0;
+}
+
+// Write the whole buffer, retrying short writes. Returns 0 or -1.
+int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// write_all() for a socket: a peer that already hung up fails the send
+// with EPIPE instead of killing the process with SIGPIPE
+int send_all(int sock, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Top up a bucket for the time since its last refill, keeping at most a
+// quarter second's worth so an idle spell does not allow a burst
+static void bucket_refill(TokenBucket *b, int64_t now) {
+    b->tokens += b->rate * (double)(now - b->refilled_ns) / 1e9;
+    if (b->tokens > b->rate / 4) b->tokens = b->rate / 4;
+    b->refilled_ns = now;
+}
+
+// Account for bytes moved in ops read or write calls against --io-limit
+// and --iops-limit, sleeping until the budget allows it. Shared by every
+// thread that hashes or copies, so the limits hold for the process.
+void throttle_io(size_t bytes, int ops) {
+    if (io_limit == 0 && iops_limit == 0) {
+        return;
+    }
+    
+    double wait = 0;
+    pthread_mutex_lock(&throttle_lock);
+    int64_t now = monotonic_ns();
+    if (io_limit > 0) {
+        bucket_refill(&io_bytes_bucket, now);
+        io_bytes_bucket.tokens -= (double)bytes;
+        if (io_bytes_bucket.tokens < 0) wait = -io_bytes_bucket.tokens / io_bytes_bucket.rate;
+    }
+    if (iops_limit > 0) {
+        bucket_refill(&io_ops_bucket, now);
+        io_ops_bucket.tokens -= ops;
+        if (io_ops_bucket.tokens < 0 && -io_ops_bucket.tokens / io_ops_bucket.rate > wait) {
+            wait = -io_ops_bucket.tokens / io_ops_bucket.rate;
+        }
+    }
+    pthread_mutex_unlock(&throttle_lock);
+    
+    if (wait > 0) {
+        struct timespec ts = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+        }
+    }
+}
+
+// write_all() for backup data, counted against the I/O limits
+int write_throttled(int fd, const void *data, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    throttle_io(len, 1);
+    return write_all(fd, data, len);
+}
+
+// Put the process in the idle I/O scheduling class (--io-idle): its disk
+// requests are only served when no other process has any pending. Threads
+// started afterwards inherit it.
+void set_idle_io() {
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    // From linux/ioprio.h, which is not always installed
+    const int who_process = 1, class_idle = 3, class_shift = 13;
+    if (syscall(SYS_ioprio_set, who_process, 0, class_idle << class_shift) != 0) {
+        fprintf(stderr, "[WARN] Cannot set idle I/O priority: %s\n", strerror(errno));
+    }
+#else
+    fprintf(stderr, "[WARN] --io-idle is only supported on Linux\n");
+#endif
+}
+
+// Record which pages of fd are in the page cache before we read it
+// (--drop-cache only). mincore() on a mapping does not fault pages in.
+void cache_map(int fd, CacheMap *map) {
+    map->resident = NULL;
+    map->pages = 0;
+    struct stat st;
+    if (!drop_cache || fstat(fd, &st) != 0 || st.st_size == 0) {
+        return;
+    }
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t pages = ((size_t)st.st_size + page - 1) / page;
+    void *addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        return;
+    }
+    map->resident = malloc(pages);
+    if (map->resident && mincore(addr, (size_t)st.st_size, (void *)map->resident) == 0) {
+        map->pages = pages;
+    } else {
+        free(map->resident);
+        map->resident = NULL;
+    }
+    munmap(addr, (size_t)st.st_size);
+}
+
+// Drop the pages of fd that cache_map() found uncached, i.e. the ones our
+// reads brought in, leaving the application's cached pages alone
+void cache_drop(int fd, CacheMap *map) {
+    if (!map->resident) {
+        return;
+    }
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < map->pages; ) {
+        if (map->resident[i] & 1) {
+            i++;
+            continue;
+        }
+        size_t start = i;
+        while (i < map->pages && !(map->resident[i] & 1)) i++;
+#ifdef POSIX_FADV_DONTNEED
+        posix_fadvise(fd, (off_t)(start * page), (off_t)((i - start) * page), POSIX_FADV_DONTNEED);
+#endif
+    }
+    free(map->resident);
+    map->resident = NULL;
+}
+
+// Write a finished backup file out and drop it from the page cache
+// (--drop-cache). Dirty pages cannot be dropped, so they are flushed
+// first; sync_file_range() skips the journal commit fdatasync() would do.
+void drop_written(int fd) {
+    if (!drop_cache) {
+        return;
+    }
+#ifdef __linux__
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                              SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+    fdatasync(fd);
+#endif
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+}
+
+#ifdef HAVE_STATX
+// Convert the fields of a statx result that the rest of the program uses
+// (for the minimal STATX_SIGNATURE mask, only those are filled in)
+static void statx_to_stat(const struct statx *sx, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(sx->stx_dev_major, sx->stx_dev_minor);
+    st->st_ino = sx->stx_ino;
+    st->st_mode = sx->stx_mode;
+    st->st_nlink = sx->stx_nlink;
+    st->st_uid = sx->stx_uid;
+    st->st_gid = sx->stx_gid;
+    st->st_size = (off_t)sx->stx_size;
+    st->st_blksize = sx->stx_blksize;
+    st->st_blocks = (blkcnt_t)sx->stx_blocks;
+    st->st_atim.tv_sec = sx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = sx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = sx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = sx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = sx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = sx->stx_ctime.tv_nsec;
+}
+
+#endif
+
+// Stat name relative to dir_fd, following symlinks. Uses statx with the
+// minimal STATX_SIGNATURE mask where available, so filesystems that have
+// to fetch attributes (NFS) are only asked for what change detection
+// uses. Returns 0 or -1.
+int stat_at(int dir_fd, const char *name, struct stat *st) {
+#ifdef HAVE_STATX
+    static _Atomic int statx_supported = 1;  // Cleared by whichever thread finds out first
+    if (statx_supported) {
+        struct statx sx;
+        if (statx(dir_fd, name, 0, STATX_SIGNATURE, &sx) == 0) {
+            statx_to_stat(&sx, st);
+            return 0;
+        }
+        if (errno != ENOSYS) {
+            return -1;
+        }
+        statx_supported = 0;
+    }
+#endif
+    return fstatat(dir_fd, name, st, 0);
+}
+
+// Was the error "this mechanism does not work here" rather than a real
+// I/O failure? Those make us fall through to the next copy method.
+static int copy_unsupported(int err) {
+    return err == EOPNOTSUPP || err == ENOTTY || err == EXDEV ||
+           err == EINVAL || err == ENOSYS;
+}
+
+// Copy src_fd into the empty dst_fd using the cheapest mechanism available:
+// a reflink (shared extents on btrfs/XFS, no data copied), or what
+// append_file_data() does. Returns 0 or -1.
+int copy_file_data(int src_fd, int dst_fd) {
+#ifdef HAVE_KERNEL_COPY
+    if (reflink_supported) {
+        if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+            throttle_io(0, 1);
+            return 0;
+        }
+        if (!copy_unsupported(errno)) return -1;
+        reflink_supported = 0;
+    }
+#endif
+    return append_file_data(src_fd, dst_fd);
+}
+
+// Copy the rest of src_fd to dst_fd at its current offset with an
+// in-kernel copy_file_range()/sendfile(), or a read/write loop. Returns 0
+// or -1.
+int append_file_data(int src_fd, int dst_fd) {
+#ifdef HAVE_KERNEL_COPY
+    // Smaller steps under an I/O limit, so the pacing stays smooth
+    size_t chunk = io_limit || iops_limit ? LARGE_READ_SIZE : COPY_CHUNK;
+    if (copy_range_supported) {
+        ssize_t n;
+        off_t copied = 0;
+        while ((n = copy_file_range(src_fd, NULL, dst_fd, NULL, chunk, 0)) != 0) {
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            throttle_io(2 * (size_t)n, 2);
+            copied += n;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (copied > 0 || !copy_unsupported(errno)) return -1;
+        copy_range_supported = 0;
+    }
+    
+    if (sendfile_supported) {
+        ssize_t n;
+        off_t copied = 0;
+        while ((n = sendfile(dst_fd, src_fd, NULL, chunk)) != 0) {
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            throttle_io(2 * (size_t)n, 2);
+            copied += n;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (copied > 0 || !copy_unsupported(errno)) return -1;
+        sendfile_supported = 0;
+    }
+#endif
+    
+    char *buffer = malloc(LARGE_READ_SIZE);
+    if (!buffer) {
+        return -1;
+    }
+    
+    ssize_t bytes;
+    while ((bytes = read(src_fd, buffer, LARGE_READ_SIZE)) != 0) {
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        throttle_io((size_t)bytes, 1);
+        if (write_throttled(dst_fd, buffer, (size_t)bytes) != 0) {
+            bytes = -1;
+            break;
+        }
+    }
+    
+    free(buffer);
+    return bytes == 0 ? 0 : -1;
+}
+
+// Parse a --compress argument, "codec" or "codec:level". The level
+// defaults to the codec's own default. Returns the Codec, or -1 if it is
+// unknown or was not compiled in.
+int parse_codec(const char *spec, int *level) {
+    const char *colon = strchr(spec, ':');
+    size_t name_len = colon ? (size_t)(colon - spec) : strlen(spec);
+    for (int i = 0; i < CODEC_COUNT; i++) {
+        if (strlen(codec_names[i]) != name_len || strncmp(spec, codec_names[i], name_len) != 0) {
+            continue;
+        }
+#ifndef HAVE_ZSTD
+        if (i == CODEC_ZSTD) return -1;
+#endif
+#ifndef HAVE_LZ4
+        if (i == CODEC_LZ4) return -1;
+#endif
+        *level = colon ? atoi(colon + 1) : codec_default_levels[i];
+        return i;
+    }
+    return -1;
+}
+
+// Start a compressed stream on fd, writing the frame header. Returns 0 or
+// -1; a compressor that failed to start needs no compressor_finish().
+int compressor_init(Compressor *c, Codec codec, int level, int fd) {
+    (void)level;  // Unused when no codec is compiled in
+    memset(c, 0, sizeof(*c));
+    c->codec = codec;
+    c->fd = fd;
+    switch (codec) {
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD:
+        c->out_size = ZSTD_CStreamOutSize();
+        c->out = malloc(c->out_size);
+        c->zstd = ZSTD_createCCtx();
+        if (!c->out || !c->zstd) break;
+        ZSTD_CCtx_setParameter(c->zstd, ZSTD_c_compressionLevel, level);
+        ZSTD_CCtx_setParameter(c->zstd, ZSTD_c_checksumFlag, 1);
+        return 0;
+#endif
+#ifdef HAVE_LZ4
+    case CODEC_LZ4: {
+        LZ4F_preferences_t prefs;
+        memset(&prefs, 0, sizeof(prefs));
+        prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+        prefs.compressionLevel = level;
+        // Room for one LARGE_READ_SIZE update or the frame end
+        c->out_size = LZ4F_compressBound(LARGE_READ_SIZE, &prefs);
+        c->out = malloc(c->out_size);
+        if (!c->out || LZ4F_isError(LZ4F_createCompressionContext(&c->lz4, LZ4F_VERSION))) {
+            break;
+        }
+        size_t n = LZ4F_compressBegin(c->lz4, c->out, c->out_size, &prefs);
+        if (LZ4F_isError(n) || write_throttled(fd, c->out, n) != 0) break;
+        return 0;
+    }
+#endif
+    case CODEC_NONE:
+        return 0;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+    
+    int err = errno ? errno : ENOMEM;
+    compressor_finish(c);
+    errno = err;
+    return -1;
+}
+
+// Compress len bytes into the stream. Returns 0 or -1.
+int compressor_write(Compressor *c, const void *data, size_t len) {
+    switch (c->codec) {
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD: {
+        ZSTD_inBuffer input = { data, len, 0 };
+        while (input.pos < input.size) {
+            ZSTD_outBuffer output = { c->out, c->out_size, 0 };
+            size_t rc = ZSTD_compressStream2(c->zstd, &output, &input, ZSTD_e_continue);
+            if (ZSTD_isError(rc)) {
+                errno = EIO;
+                return -1;
+            }
+            if (write_throttled(c->fd, c->out, output.pos) != 0) return -1;
+        }
+        return 0;
+    }
+#endif
+#ifdef HAVE_LZ4
+    case CODEC_LZ4:
+        while (len > 0) {
+            size_t part = len < LARGE_READ_SIZE ? len : LARGE_READ_SIZE;
+            size_t n = LZ4F_compressUpdate(c->lz4, c->out, c->out_size, data, part, NULL);
+            if (LZ4F_isError(n)) {
+                errno = EIO;
+                return -1;
+            }
+            if (write_throttled(c->fd, c->out, n) != 0) return -1;
+            data = (const char *)data + part;
+            len -= part;
+        }
+        return 0;
+#endif
+    default:
+        return write_throttled(c->fd, data, len);
+    }
+}
+
+// End the frame and release the compressor. Returns 0 or -1.
+int compressor_finish(Compressor *c) {
+    int failed = 0;
+#ifdef HAVE_ZSTD
+    if (c->zstd) {
+        ZSTD_inBuffer input = { NULL, 0, 0 };
+        size_t remaining;
+        do {
+            ZSTD_outBuffer output = { c->out, c->out_size, 0 };
+            remaining = c->out ? ZSTD_compressStream2(c->zstd, &output, &input, ZSTD_e_end) : 0;
+            if (ZSTD_isError(remaining) || write_throttled(c->fd, c->out, output.pos) != 0) {
+                failed = -1;
+                break;
+            }
+        } while (remaining != 0);
+        ZSTD_freeCCtx(c->zstd);
+    }
+#endif
+#ifdef HAVE_LZ4
+    if (c->lz4) {
+        size_t n = LZ4F_compressEnd(c->lz4, c->out, c->out_size, NULL);
+        if (LZ4F_isError(n) || write_throttled(c->fd, c->out, n) != 0) failed = -1;
+        LZ4F_freeCompressionContext(c->lz4);
+    }
+#endif
+    free(c->out);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+    return failed;
+}
+
+// Compress src_fd into the empty dst_fd with codec at compress_level,
+// counting the bytes read in *copied. The data has to pass through user
+// space, so this replaces the reflink and in-kernel paths of
+// copy_file_data(). Returns 0 or -1.
+int compress_file_data(int src_fd, int dst_fd, Codec codec, long long *copied) {
+    Compressor compressor;
+    char *buffer = malloc(LARGE_READ_SIZE);
+    if (!buffer) {
+        return -1;
+    }
+    if (compressor_init(&compressor, codec, compress_level, dst_fd) != 0) {
+        free(buffer);
+        return -1;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    
+    ssize_t bytes;
+    while ((bytes = read(src_fd, buffer, LARGE_READ_SIZE)) != 0) {
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        throttle_io((size_t)bytes, 1);
+        if (compressor_write(&compressor, buffer, (size_t)bytes) != 0) {
+            bytes = -1;
+            break;
+        }
+        *copied += bytes;
+    }
+    
+    free(buffer);
+    if (compressor_finish(&compressor) != 0) bytes = -1;
+    return bytes == 0 ? 0 : -1;
+}
+
+// Decompress a zstd or LZ4 frame stream from src_fd into dst_fd, the
+// reverse of compress_file_data(). Returns 0, or -1 with errno set
+// (ENOTSUP if the codec was not compiled in).
+int decompress_file_data(int src_fd, int dst_fd, Codec codec) {
+    size_t in_size = LARGE_READ_SIZE, out_size = LARGE_READ_SIZE;
+    char *in = malloc(in_size), *out = malloc(out_size);
+    int failed = !in || !out ? -1 : 0;
+    ssize_t bytes = 0;
+    (void)src_fd;  // Unused when no codec is compiled in
+    (void)dst_fd;
+    (void)bytes;
+    
+    switch (failed ? CODEC_NONE : codec) {
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD: {
+        ZSTD_DCtx *dctx = ZSTD_createDCtx();
+        size_t rc = 1;  // Non-zero until a frame is complete
+        failed = dctx ? 0 : -1;
+        while (!failed && (bytes = read(src_fd, in, in_size)) != 0) {
+            if (bytes < 0) {
+                if (errno == EINTR) continue;
+                failed = -1;
+                break;
+            }
+            throttle_io((size_t)bytes, 1);
+            ZSTD_inBuffer input = { in, (size_t)bytes, 0 };
+            while (!failed && input.pos < input.size) {
+                ZSTD_outBuffer output = { out, out_size, 0 };
+                rc = ZSTD_decompressStream(dctx, &output, &input);
+                if (ZSTD_isError(rc) || write_throttled(dst_fd, out, output.pos) != 0) {
+                    if (ZSTD_isError(rc)) errno = EIO;
+                    failed = -1;
+                }
+            }
+        }
+        if (!failed && rc != 0) {
+            errno = EIO;  // Truncated frame
+            failed = -1;
+        }
+        ZSTD_freeDCtx(dctx);
+        break;
+    }
+#endif
+#ifdef HAVE_LZ4
+    case CODEC_LZ4: {
+        LZ4F_dctx *dctx = NULL;
+        size_t hint = 1;
+        failed = LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)) ? -1 : 0;
+        while (!failed && (bytes = read(src_fd, in, in_size)) != 0) {
+            if (bytes < 0) {
+                if (errno == EINTR) continue;
+                failed = -1;
+                break;
+            }
+            throttle_io((size_t)bytes, 1);
+            size_t pos = 0;
+            while (!failed && pos < (size_t)bytes) {
+                size_t out_len = out_size, in_len = (size_t)bytes - pos;
+                hint = LZ4F_decompress(dctx, out, &out_len, in + pos, &in_len, NULL);
+                if (LZ4F_isError(hint) || write_throttled(dst_fd, out, out_len) != 0) {
+                    if (LZ4F_isError(hint)) errno = EIO;
+                    failed = -1;
+                }
+                pos += in_len;
+            }
+        }
+        if (!failed && hint != 0) {
+            errno = EIO;
+            failed = -1;
+        }
+        LZ4F_freeDecompressionContext(dctx);
+        break;
+    }
+#endif
+    default:
+        if (!failed) {
+            errno = ENOTSUP;
+            failed = -1;
+        }
+        break;
+    }
+    
+    free(in);
+    free(out);
+    return failed;
+}
+
+// Build the versioned backup path for a tracked file (name is relative to
+// watch_directory). Each file's versions get a directory of their own,
+// .autobackup/versions/<name>/ (created here), so no directory holds more
+// than one file's history.
+int backup_path_for(const char *name, int version, char *backup_path) {
+    char backup_dir[MAX_PATH];
+    const char *filename = strrchr(name, '/');
+    filename = filename ? filename + 1 : name;
+    if (format_path(backup_dir, "%s/%s/%s", root->backup_directory, VERSIONS_DIR, name) != 0 ||
+        make_dirs(backup_dir) != 0) {
+        fprintf(stderr, "[ERROR] Cannot create the version directory for %s: %s\n",
+                name, strerror(errno));
+        return -1;
+    }
+    
+    // Extract name and extension
+    char base[MAX_PATH], ext[MAX_PATH];
+    const char *dot = strrchr(filename, '.');
+    
+    if (dot) {
+        size_t name_len = dot - filename;
+        if (name_len >= MAX_PATH) name_len = MAX_PATH - 1;
+        strncpy(base, filename, name_len);
+        base[name_len] = '\0';
+        strncpy(ext, dot, MAX_PATH - 1);
+        ext[MAX_PATH - 1] = '\0';
+    } else {
+        strncpy(base, filename, MAX_PATH - 1);
+        base[MAX_PATH - 1] = '\0';
+        ext[0] = '\0';
+    }
+    
+    // Create backup filename: name_v1_backup_20240101_120000.ext[.zst]
+    if (format_path(backup_path, "%s/%s_v%d_backup_%s%s%s", backup_dir, base, version,
+                    get_timestamp(), ext, codec_suffixes[compress_codec]) != 0) {
+        fprintf(stderr, "[ERROR] Backup path too long for %s\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+// Copy src_path to dest (created or truncated), compressed with codec.
+// *copied receives the number of bytes copied, before compression.
+// Returns 0 on success; a failed copy leaves no partial file behind.
+int copy_to_path(const char *src_path, const char *dest, Codec codec, long long *copied) {
+    int src = open(src_path, O_RDONLY | O_CLOEXEC);
+    int dst = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    
+    if (src < 0 || dst < 0) {
+        fprintf(stderr, "[ERROR] Failed to create backup: %s (%s)\n",
+                dest, strerror(errno));
+        if (src >= 0) close(src);
+        if (dst >= 0) {
+            close(dst);
+            unlink(dest);
+        }
+        return -1;
+    }
+    
+    CacheMap cache;
+    cache_map(src, &cache);
+    struct stat st;
+    *copied = 0;
+    int failed = codec != CODEC_NONE ? compress_file_data(src, dst, codec, copied)
+                                     : copy_file_data(src, dst);
+    if (!failed && codec == CODEC_NONE) {
+        failed = fstat(dst, &st);
+        *copied = (long long)st.st_size;
+    }
+    int err = errno;
+    if (!failed) drop_written(dst);
+    cache_drop(src, &cache);
+    close(src);
+    if (close(dst) != 0 && !failed) {
+        failed = -1;
+        err = errno;
+    }
+    
+    if (failed) {
+        fprintf(stderr, "[ERROR] Failed to create backup: %s (%s)\n",
+                dest, strerror(err));
+        unlink(dest);
+        return -1;
+    }
+    return 0;
+}
+
+// Create a versioned backup of a tracked file, storing its path in
+// backup_path and the size of the content copied in *size. The copy is
+// made in the staging directory and renamed into place, so a backup file
+// under its final name is always complete. Returns 0 on success.
+int create_backup(const char *name, int version, char *backup_path, long long *size) {
+    char filepath[MAX_PATH], staged[MAX_PATH];
+    if (format_path(filepath, "%s/%s", root->watch_directory, name) != 0) {
+        fprintf(stderr, "[ERROR] Path too long: %s/%s\n", root->watch_directory, name);
+        return -1;
+    }
+    int fd = format_path(staged, "%s/stage_XXXXXX", root->staging_directory) == 0
+                 ? mkstemp(staged) : -1;
+    if (fd < 0) {
+        fprintf(stderr, "[ERROR] Cannot create staging file in %s: %s\n",
+                root->staging_directory, strerror(errno));
+        return -1;
+    }
+    close(fd);
+    if (copy_to_path(filepath, staged, compress_codec, size) != 0) {
+        return -1;
+    }
+    return publish_backup(staged, name, version, backup_path);
+}
+
+// Hash worker: claim jobs from the batch until none are left
+void *hash_worker(void *arg) {
+    HashBatch *batch = arg;
+    root = batch->root;
+    
+    while (1) {
+        pthread_mutex_lock(&batch->lock);
+        size_t i = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+        if (i >= batch->count) {
+            break;
+        }
+        
+        HashJob *job = &batch->jobs[i];
+        if (job->skip) {
+            continue;
+        }
+        if (single_pass && job->index >= 0) {
+            job->status = hash_and_stage(job);
+            continue;
+        }
+        
+        char filepath[MAX_PATH];
+        if (format_path(filepath, "%s/%s", root->watch_directory, job->name) != 0) {
+            job->status = -1;
+            continue;
+        }
+        job->status = calculate_hash(filepath, hash_algo, job->hash);
+        
+        // Entries recorded with another algorithm also need a comparable hash
+        if (job->status == 0 && job->algo != hash_algo) {
+            job->status = calculate_hash(filepath, job->algo, job->prev_hash);
+        } else {
+            memcpy(job->prev_hash, job->hash, HASH_LEN);
+        }
+    }
+    return NULL;
+}
+
+// Cheap fingerprint of a large file: SAMPLE_BLOCKS blocks spread evenly
+// from its first to its last byte, hashed together. A different value
+// proves the content changed; an equal one is only a strong hint that it
+// did not. Returns 0 if the file cannot be read.
+uint64_t sample_fingerprint(const char *name, off_t size) {
+    int fd = openat(root->watch_fd, name, O_RDONLY | O_CLOEXEC);
+    unsigned char *block = malloc(SAMPLE_BLOCK);
+    Hasher hasher;
+    if (fd < 0 || !block || hasher_init(&hasher, hash_algo) != 0) {
+        if (fd >= 0) close(fd);
+        free(block);
+        return 0;
+    }
+    
+    int failed = 0;
+    hasher_update(&hasher, &size, sizeof(size));
+    for (int i = 0; i < SAMPLE_BLOCKS && !failed; i++) {
+        off_t offset = (size - SAMPLE_BLOCK) / (SAMPLE_BLOCKS - 1) * i;
+        if (i == SAMPLE_BLOCKS - 1) offset = size - SAMPLE_BLOCK;
+        ssize_t bytes = pread(fd, block, SAMPLE_BLOCK, offset);
+        if (bytes < 0) failed = 1;
+        else hasher_update(&hasher, block, (size_t)bytes);
+        throttle_io(bytes > 0 ? (size_t)bytes : 0, 1);
+    }
+    
+    unsigned char hash[HASH_LEN];
+    hasher_final(&hasher, hash);
+    close(fd);
+    free(block);
+    if (failed) {
+        return 0;
+    }
+    uint64_t sample;
+    memcpy(&sample, hash, sizeof(sample));
+    return sample ? sample : 1;  // 0 means "no fingerprint"
+}
+
+// Hash every job, spreading the batch over worker_threads threads, or
+// with overlapped reads on this thread when io_uring is in use. With
+// --sample-large, huge files of unchanged size are sampled first and not
+// hashed if the fingerprint matches; the others get a fingerprint
+// afterwards (their pages are still cached, so it costs no disk reads).
+void hash_jobs(HashJob *jobs, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        HashJob *job = &jobs[i];
+        if (job->sample_first) {
+            job->sample = sample_fingerprint(job->name, job->st.st_size);
+            job->skip = job->sample != 0 && job->sample == job->prev_sample;
+        }
+    }
+    
+    int hashed = 0;
+#ifdef HAVE_IO_URING
+    hashed = use_uring && !single_pass && uring_hash_jobs(jobs, count) == 0;
+#endif
+    if (!hashed) {
+        hash_jobs_threaded(jobs, count);
+    }
+    
+    uint64_t hashes = 0, bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        HashJob *job = &jobs[i];
+        if (sample_large && !job->skip && job->status == 0 && !job->sample &&
+            job->st.st_size >= SAMPLE_MIN_SIZE) {
+            job->sample = sample_fingerprint(job->name, job->st.st_size);
+        }
+        if (job->sample_first || job->sample) {
+            bytes += (uint64_t)SAMPLE_BLOCKS * SAMPLE_BLOCK;
+        }
+        if (job->status == 0 && !job->skip) {
+            hashes++;
+            bytes += (uint64_t)job->st.st_size;
+        }
+    }
+    METRIC_ADD(hashes, hashes);
+    METRIC_ADD(bytes_read, bytes);
+}
+
+// Hash every job, spreading the batch over worker_threads threads
+void hash_jobs_threaded(HashJob *jobs, size_t count) {
+    HashBatch batch = { .root = root, .jobs = jobs, .count = count, .next = 0 };
+    pthread_mutex_init(&batch.lock, NULL);
+    
+    int threads = worker_threads;
+    if ((size_t)threads > count) threads = (int)count;
+    
+    pthread_t tids[MAX_THREADS];
+    int started = 0;
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&tids[started], NULL, hash_worker, &batch) != 0) {
+            break;
+        }
+        started++;
+    }
+    hash_worker(&batch);
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    
+    pthread_mutex_destroy(&batch.lock);
+}
+
+#ifdef HAVE_IO_URING
+// Release whatever uring_init() managed to set up
+void uring_exit(Uring *ring) {
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0) close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// Map a shared ring region, returns NULL on failure
+static void *uring_map(int fd, size_t size, off_t offset) {
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+// Set up a ring through the raw syscalls and check that the kernel
+// supports the operations we use (IORING_OP_STATX and IORING_OP_READ
+// need Linux 5.6). Returns 0 on success, -1 with errno set otherwise.
+int uring_init(Uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = uring_map(ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+    if (ring->sq_ring && (params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cq_ring = ring->sq_ring;
+    } else if (ring->sq_ring) {
+        ring->cq_ring = uring_map(ring->fd, ring->cq_ring_size, IORING_OFF_CQ_RING);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = uring_map(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+    if (!ring->sq_ring || !ring->cq_ring || !ring->sqes) {
+        int saved = errno;
+        uring_exit(ring);
+        errno = saved;
+        return -1;
+    }
+    
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->entries = params.sq_entries;
+    ring->tail = *ring->sq_tail;
+    
+    size_t probe_size = sizeof(struct io_uring_probe) +
+                        IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_size);
+    int supported = probe &&
+        syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0 &&
+        probe->ops_len > IORING_OP_READ &&
+        (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED) &&
+        (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if (!supported) {
+        uring_exit(ring);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    return 0;
+}
+
+// Claim the next submission entry, NULL if the queue is full
+static struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->tail - head >= ring->entries) {
+        return NULL;
+    }
+    unsigned slot = ring->tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[slot] = slot;
+    ring->tail++;
+    return sqe;
+}
+
+// Submit everything queued and wait for at least wait_nr completions.
+// Returns 0, or -1 if the ring itself failed.
+int uring_submit(Uring *ring, unsigned wait_nr) {
+    __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+    while (1) {
+        unsigned queued = ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        long ret = syscall(__NR_io_uring_enter, ring->fd, queued, wait_nr,
+                           wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0 || errno != EINTR) {
+            return ret < 0 ? -1 : 0;
+        }
+    }
+}
+
+// Oldest unseen completion, NULL if there is none yet
+static struct io_uring_cqe *uring_peek(Uring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+// Hand the completion returned by uring_peek() back to the kernel
+static void uring_seen(Uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Submit anything still queued and wait for the next completion, NULL if
+// the ring failed
+static struct io_uring_cqe *uring_wait(Uring *ring) {
+    struct io_uring_cqe *cqe = uring_peek(ring);
+    if (ring->tail != __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) || !cqe) {
+        if (uring_submit(ring, cqe ? 0 : 1) != 0) {
+            return NULL;
+        }
+    }
+    while (!(cqe = uring_peek(ring))) {
+        if (uring_submit(ring, 1) != 0) {
+            return NULL;
+        }
+    }
+    return cqe;
+}
+
+// The ring stopped working: report it and use the blocking path from now
+// on. Operations still in flight may write into their buffers, so callers
+// free them only through uring_abandon().
+static void uring_failed() {
+    fprintf(stderr, "[WARN] io_uring failed (%s), using blocking I/O\n", strerror(errno));
+    use_uring = 0;
+}
+
+// Free the buffer of a wave the failed ring still owes `owed` completions
+// for, once the operations the kernel took have completed. Entries it never
+// consumed cannot complete. If some are still running after a second the
+// buffer stays allocated, as the kernel may yet write into it.
+static void uring_abandon(void *buffer, size_t owed) {
+    size_t unsubmitted = io_ring.tail - __atomic_load_n(io_ring.sq_head, __ATOMIC_ACQUIRE);
+    size_t in_flight = owed > unsubmitted ? owed - unsubmitted : 0;
+    for (int waited = 0; in_flight > 0 && waited < 1000; ) {
+        if (uring_peek(&io_ring)) {
+            uring_seen(&io_ring);
+            in_flight--;
+        } else {
+            poll(NULL, 0, 1);
+            waited++;
+        }
+    }
+    if (in_flight == 0) {
+        free(buffer);
+    }
+}
+
+// Stat every job's file relative to watch_fd, a ring's worth of statx
+// calls per io_uring_enter(). Sets job->status to 0 or -1; returns -1 if
+// the ring failed and the caller has to stat the jobs itself.
+int uring_stat_jobs(HashJob *jobs, size_t count) {
+    struct statx *results = malloc(io_ring.entries * sizeof(struct statx));
+    if (!results) {
+        return -1;
+    }
+    
+    for (size_t start = 0; start < count; start += io_ring.entries) {
+        size_t wave = count - start < io_ring.entries ? count - start : io_ring.entries;
+        for (size_t i = 0; i < wave; i++) {
+            struct io_uring_sqe *sqe = uring_get_sqe(&io_ring);
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = root->watch_fd;
+            sqe->addr = (uintptr_t)jobs[start + i].name;
+            sqe->len = STATX_SIGNATURE;
+            sqe->off = (uintptr_t)&results[i];
+            sqe->user_data = i;
+        }
+        if (uring_submit(&io_ring, (unsigned)wave) != 0) {
+            uring_failed();
+            uring_abandon(results, wave);
+            return -1;
+        }
+        for (size_t done = 0; done < wave; done++) {
+            struct io_uring_cqe *cqe = uring_wait(&io_ring);
+            if (!cqe) {
+                uring_failed();
+                uring_abandon(results, wave - done);
+                return -1;
+            }
+            HashJob *job = &jobs[start + cqe->user_data];
+            job->status = cqe->res < 0 ? -1 : 0;
+            if (cqe->res >= 0) {
+                statx_to_stat(&results[cqe->user_data], &job->st);
+            }
+            uring_seen(&io_ring);
+        }
+    }
+    free(results);
+    return 0;
+}
+
+// Queue the next read of a file being hashed
+static void uring_queue_read(UringRead *read, size_t slot) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&io_ring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = read->fd;
+    sqe->addr = (uintptr_t)read->buffer;
+    sqe->len = URING_READ_SIZE;
+    sqe->off = (uint64_t)read->offset;
+    sqe->user_data = slot;
+}
+
+// Open the job's file and queue its first read. Returns -1 (with the job
+// failed) if the file cannot be opened.
+static int uring_start_read(UringRead *read, HashJob *job, size_t slot) {
+    read->job = job;
+    read->offset = 0;
+    read->need_prev = job->algo != hash_algo;
+    read->fd = openat(root->watch_fd, job->name, O_RDONLY | O_CLOEXEC);
+    if (read->fd < 0) {
+        job->status = -1;
+        read->job = NULL;
+        return -1;
+    }
+    if (hasher_init(&read->hasher, hash_algo) != 0) {
+        close(read->fd);
+        job->status = -1;
+        read->job = NULL;
+        return -1;
+    }
+    if (read->need_prev && hasher_init(&read->prev_hasher, job->algo) != 0) {
+        hasher_final(&read->hasher, job->hash);
+        close(read->fd);
+        job->status = -1;
+        read->job = NULL;
+        return -1;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(read->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    cache_map(read->fd, &read->cache);
+    uring_queue_read(read, slot);
+    return 0;
+}
+
+// Finish hashing a file and free its slot
+static void uring_finish_read(UringRead *read, int status) {
+    HashJob *job = read->job;
+    hasher_final(&read->hasher, job->hash);
+    if (read->need_prev) {
+        hasher_final(&read->prev_hasher, job->prev_hash);
+    } else {
+        memcpy(job->prev_hash, job->hash, HASH_LEN);
+    }
+    cache_drop(read->fd, &read->cache);
+    close(read->fd);
+    job->status = status;
+    read->job = NULL;
+}
+
+// Hash a batch on the calling thread with io_uring. Up to URING_READS
+// files are read at once, one read in flight per file (hashing is
+// sequential), and each completed buffer is hashed while the other reads
+// proceed, so one thread keeps the device queue full. Every job gets a
+// status; jobs not finished when the ring fails are marked -1 and picked
+// up again on the next check. Returns -1 without touching the jobs if no
+// read buffers could be allocated.
+int uring_hash_jobs(HashJob *jobs, size_t count) {
+    UringRead reads[URING_READS];
+    size_t slots = URING_READS < io_ring.entries ? URING_READS : io_ring.entries;
+    size_t next = 0, active = 0;
+    
+    memset(reads, 0, sizeof(reads));
+    for (size_t s = 0; s < slots; s++) {
+        if (posix_memalign((void **)&reads[s].buffer, 4096, URING_READ_SIZE) != 0) {
+            slots = s;
+            break;
+        }
+    }
+    if (slots == 0) {
+        return -1;
+    }
+    
+    while (1) {
+        for (size_t s = 0; s < slots && next < count; s++) {
+            while (!reads[s].job && next < count) {
+                if (jobs[next].skip) {
+                    next++;
+                } else if (uring_start_read(&reads[s], &jobs[next++], s) == 0) {
+                    active++;
+                }
+            }
+        }
+        if (active == 0) {
+            break;
+        }
+        
+        struct io_uring_cqe *cqe = uring_wait(&io_ring);
+        if (!cqe) {
+            // In-flight reads may still land in the buffers: leak them
+            uring_failed();
+            for (size_t s = 0; s < slots; s++) {
+                if (reads[s].job) uring_finish_read(&reads[s], -1);
+            }
+            for (; next < count; next++) jobs[next].status = -1;
+            return 0;
+        }
+        
+        // Drain every completion that is ready before submitting again
+        do {
+            UringRead *read = &reads[cqe->user_data];
+            int res = cqe->res;
+            uring_seen(&io_ring);
+            if (res == -EAGAIN || res == -EINTR) {
+                uring_queue_read(read, (size_t)(read - reads));
+            } else if (res <= 0) {
+                uring_finish_read(read, res == 0 ? 0 : -1);
+                active--;
+            } else {
+                throttle_io((size_t)res, 1);
+                hasher_update(&read->hasher, read->buffer, (size_t)res);
+                if (read->need_prev) {
+                    hasher_update(&read->prev_hasher, read->buffer, (size_t)res);
+                }
+                read->offset += res;
+                uring_queue_read(read, (size_t)(read - reads));
+            }
+        } while ((cqe = uring_peek(&io_ring)) != NULL);
+    }
+    
+    for (size_t s = 0; s < slots; s++) {
+        free(reads[s].buffer);
+    }
+    return 0;
+}
+#endif
+
+// Stat each job's file into job->st, setting job->status to 0 or -1.
+// Consecutive files in the same directory (the usual case, as the walker
+// adds a directory's files together) are looked up relative to one open
+// descriptor of it, so only their last path component is resolved.
+void stat_jobs(HashJob *jobs, size_t count) {
+#ifdef HAVE_IO_URING
+    if (use_uring && uring_stat_jobs(jobs, count) == 0) {
+        METRIC_ADD(files_statted, count);
+        return;
+    }
+#endif
+    char dir[MAX_PATH] = "";
+    size_t dir_len = 0;
+    int dir_fd = root->watch_fd;
+    for (size_t i = 0; i < count; i++) {
+        const char *name = jobs[i].name;
+        const char *slash = strrchr(name, '/');
+        size_t len = slash ? (size_t)(slash - name) : 0;
+        
+        if (len != dir_len || strncmp(name, dir, len) != 0) {
+            if (dir_fd != root->watch_fd) close(dir_fd);
+            dir_fd = root->watch_fd;
+            dir_len = len < MAX_PATH ? len : 0;
+            memcpy(dir, name, dir_len);
+            dir[dir_len] = '\0';
+            if (dir_len > 0) {
+                int fd = openat(root->watch_fd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (fd >= 0) dir_fd = fd;
+            }
+        }
+        
+        const char *base = dir_fd != root->watch_fd ? slash + 1 : name;
+        jobs[i].status = stat_at(dir_fd, base, &jobs[i].st);
+    }
+    if (dir_fd != root->watch_fd) close(dir_fd);
+    METRIC_ADD(files_statted, count);
+}
+
+// Read a file once, hashing it and copying it into a staging file in the
+// same pass. On success job->staged names the copy, which holds exactly
+// the bytes that were hashed (compressed if it will be a plain backup).
+int hash_and_stage(HashJob *job) {
+    // Entries recorded with another algorithm get both hashes in one pass
+    Hasher hasher, prev_hasher;
+    int need_prev = job->algo != hash_algo;
+    if (hasher_init(&hasher, hash_algo) != 0) {
+        return -1;
+    }
+    if (need_prev && hasher_init(&prev_hasher, job->algo) != 0) {
+        hasher_final(&hasher, job->hash);
+        return -1;
+    }
+    
+    char filepath[MAX_PATH], staged[MAX_PATH];
+    
+    // Only plain backups are compressed; stores address objects by content
+    Codec codec = (dedup || chunked) ? CODEC_NONE : compress_codec;
+    Compressor compressor;
+    int compressing = 0;
+    int failed = 0;
+    void *buffer = NULL;
+    int src = format_path(filepath, "%s/%s", root->watch_directory, job->name) == 0
+                  ? open(filepath, O_RDONLY | O_CLOEXEC) : -1;
+    int dst = src >= 0 && format_path(staged, "%s/stage_XXXXXX", root->staging_directory) == 0
+                  ? mkstemp(staged) : -1;
+    if (src < 0) {
+        failed = -1;
+    } else if (dst < 0 || posix_memalign(&buffer, 4096, LARGE_READ_SIZE) != 0) {
+        fprintf(stderr, "[ERROR] Cannot create staging file in %s: %s\n",
+                root->staging_directory, strerror(errno));
+        failed = -1;
+    } else if (compressor_init(&compressor, codec, compress_level, dst) != 0) {
+        fprintf(stderr, "[ERROR] Cannot start %s compression: %s\n",
+                codec_names[codec], strerror(errno));
+        failed = -1;
+    } else {
+        compressing = 1;
+        fchmod(dst, 0644);
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(src, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    }
+    CacheMap cache = {0};
+    if (!failed) cache_map(src, &cache);
+    
+    ssize_t bytes;
+    job->staged_size = 0;
+    while (!failed && (bytes = read(src, buffer, LARGE_READ_SIZE)) != 0) {
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            failed = -1;
+            break;
+        }
+        throttle_io((size_t)bytes, 1);
+        job->staged_size += bytes;
+        hasher_update(&hasher, buffer, (size_t)bytes);
+        if (need_prev) hasher_update(&prev_hasher, buffer, (size_t)bytes);
+        if (compressor_write(&compressor, buffer, (size_t)bytes) != 0) {
+            failed = -1;
+        }
+    }
+    if (compressing && compressor_finish(&compressor) != 0) {
+        failed = -1;
+    }
+    
+    hasher_final(&hasher, job->hash);
+    if (need_prev) {
+        hasher_final(&prev_hasher, job->prev_hash);
+    } else {
+        memcpy(job->prev_hash, job->hash, HASH_LEN);
+    }
+    
+    free(buffer);
+    if (src >= 0) {
+        cache_drop(src, &cache);
+        close(src);
+    }
+    if (dst >= 0) {
+        // A plain backup's staged copy is not read again; stores read it
+        if (!failed && !dedup && !chunked) drop_written(dst);
+        if (close(dst) != 0) failed = -1;
+        if (failed) unlink(staged);
+    }
+    if (failed) {
+        return -1;
+    }
+    job->staged = strdup(staged);
+    return 0;
+}
+
+// Move a staged copy into place as the given backup version
+int publish_backup(const char *staged, const char *name, int version, char *backup_path) {
+    if (backup_path_for(name, version, backup_path) != 0) {
+        fprintf(stderr, "[ERROR] Failed to create backup: %s v%d (no backup path)\n",
+                name, version);
+        unlink(staged);
+        return -1;
+    }
+    if (rename(staged, backup_path) != 0) {
+        fprintf(stderr, "[ERROR] Failed to create backup: %s (%s)\n",
+                backup_path, strerror(errno));
+        unlink(staged);
+        return -1;
+    }
+    
+    printf("✓ Backed up: %s → v%d (hash changed)\n", name, version);
+    return 0;
+}
+
+// Location of a hash in a content-addressed store (OBJECTS_DIR or
+// MANIFESTS_DIR), relative to backup_directory:
+// <store>/<first two hex digits>/<remaining hex digits>
+void object_location(const char *store, const unsigned char *hash, HashAlgo algo,
+                     char *location) {
+    char hex[HASH_SIZE];
+    hash_to_hex(hash, hex);
+    hex[hash_algo_lengths[algo] * 2] = '\0';
+    format_path(location, "%s/%.2s/%s", store, hex, hex + 2);  // Always fits
+}
+
+// Write an in-memory object into a store unless it is already there.
+// The object appears atomically (staging file + rename).
+int write_object(const char *store, const void *data, size_t len,
+                 const unsigned char *hash, int *existed) {
+    char location[MAX_PATH], object_path[MAX_PATH], object_dir[MAX_PATH];
+    object_location(store, hash, hash_algo, location);
+    if (format_path(object_path, "%s/%s", root->backup_directory, location) != 0) {
+        fprintf(stderr, "[ERROR] Failed to store object %s: %s\n", location, strerror(errno));
+        return -1;
+    }
+    
+    *existed = object_exists(object_path);
+    if (*existed) {
+        return 0;
+    }
+    
+    char temp[MAX_PATH];
+    int fd = format_path(temp, "%s/stage_XXXXXX", root->staging_directory) == 0
+                 ? mkstemp(temp) : -1;
+    if (fd < 0) {
+        fprintf(stderr, "[ERROR] Cannot create staging file in %s: %s\n",
+                root->staging_directory, strerror(errno));
+        return -1;
+    }
+    fchmod(fd, 0644);
+    int failed = write_throttled(fd, data, len);
+    if (!failed) drop_written(fd);
+    if (close(fd) != 0) failed = -1;
+    
+    strcpy(object_dir, object_path);
+    *strrchr(object_dir, '/') = '\0';
+    if (failed || make_dirs(object_dir) != 0 || rename(temp, object_path) != 0) {
+        fprintf(stderr, "[ERROR] Failed to store object %s: %s\n",
+                object_path, strerror(errno));
+        unlink(temp);
+        return -1;
+    }
+    return 0;
+}
+
+// Fill the gear table used by the chunker. It must be identical across
+// runs so equal content keeps cutting at the same places, hence a fixed
+// seed through splitmix64.
+void init_gear_table() {
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear_table[i] = z ^ (z >> 31);
+    }
+}
+
+// Store one chunk and append its "<hash> <length>" line to the manifest
+int emit_chunk(ChunkList *list, const unsigned char *chunk, size_t len) {
+    unsigned char hash[HASH_LEN];
+    Hasher h;
+    int existed;
+    if (hasher_init(&h, hash_algo) != 0) {
+        return -1;
+    }
+    hasher_update(&h, chunk, len);
+    hasher_final(&h, hash);
+    if (write_object(OBJECTS_DIR, chunk, len, hash, &existed) != 0) {
+        return -1;
+    }
+    
+    if (list->capacity - list->length < HASH_SIZE + 24) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 4096;
+        char *grown = realloc(list->manifest, capacity);
+        if (!grown) {
+            return -1;
+        }
+        list->manifest = grown;
+        list->capacity = capacity;
+    }
+    char hex[HASH_SIZE];
+    hash_to_hex(hash, hex);
+    hex[hash_algo_lengths[hash_algo] * 2] = '\0';
+    list->length += (size_t)sprintf(list->manifest + list->length, "%s %zu\n", hex, len);
+    
+    list->chunks++;
+    if (!existed) {
+        list->new_chunks++;
+        list->new_bytes += (long long)len;
+    }
+    return 0;
+}
+
+// Store the job's content as content-defined chunks. Each chunk goes into
+// the object store and the ordered list of "<chunk hash> <length>" lines
+// becomes a manifest named by the whole-file hash. Content whose manifest
+// already exists is not read again. Reads the staged copy when there is
+// one, otherwise the source file, and files the manifest under the hash
+// of the bytes actually read.
+int store_chunked(HashJob *job, int version, char *location, unsigned char *stored_hash,
+                  int *existed) {
+    memcpy(stored_hash, job->hash, HASH_LEN);
+    object_location(MANIFESTS_DIR, stored_hash, hash_algo, location);
+    
+    char path[MAX_PATH];
+    if (format_path(path, "%s/%s", root->backup_directory, location) != 0) {
+        fprintf(stderr, "[ERROR] Failed to store manifest %s: %s\n", location, strerror(errno));
+        return -1;
+    }
+    *existed = object_exists(path);
+    if (*existed) {
+        if (job->staged) unlink(job->staged);
+        printf("✓ Backed up: %s → v%d (content already stored)\n", job->name, version);
+        return 0;
+    }
+    
+    const char *source = job->staged;
+    if (!source && format_path(path, "%s/%s", root->watch_directory, job->name) == 0) {
+        source = path;
+    }
+    int fd = source ? open(source, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd < 0) {
+        return -1;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    
+    unsigned char *buffer = malloc(LARGE_READ_SIZE);
+    unsigned char *chunk = malloc(CHUNK_MAX);
+    Hasher whole;
+    ChunkList list = {0};
+    int failed = !buffer || !chunk || hasher_init(&whole, hash_algo) != 0;
+    if (failed) {
+        free(buffer);
+        free(chunk);
+        close(fd);
+        return -1;
+    }
+    CacheMap cache;
+    cache_map(fd, &cache);
+    
+    size_t chunk_len = 0;
+    uint64_t fp = 0;
+    ssize_t bytes;
+    while (!failed && (bytes = read(fd, buffer, LARGE_READ_SIZE)) != 0) {
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            failed = -1;
+            break;
+        }
+        throttle_io((size_t)bytes, 1);
+        hasher_update(&whole, buffer, (size_t)bytes);
+        
+        // Gear rolling hash; cut where the masked fingerprint is zero, with
+        // a stricter mask below the average size to normalize chunk sizes
+        for (ssize_t i = 0; i < bytes && !failed; i++) {
+            chunk[chunk_len++] = buffer[i];
+            fp = (fp << 1) + gear_table[buffer[i]];
+            if (chunk_len < CHUNK_MIN) continue;
+            uint64_t mask = chunk_len < CHUNK_AVG ? CHUNK_MASK_SMALL : CHUNK_MASK_LARGE;
+            if (chunk_len < CHUNK_MAX && (fp & mask) != 0) continue;
+            
+            failed = emit_chunk(&list, chunk, chunk_len);
+            chunk_len = 0;
+            fp = 0;
+        }
+    }
+    if (!failed && chunk_len > 0) {
+        failed = emit_chunk(&list, chunk, chunk_len);
+    }
+    
+    hasher_final(&whole, stored_hash);
+    cache_drop(fd, &cache);
+    close(fd);
+    free(buffer);
+    free(chunk);
+    if (job->staged) unlink(job->staged);
+    
+    if (!failed) {
+        object_location(MANIFESTS_DIR, stored_hash, hash_algo, location);
+        failed = write_object(MANIFESTS_DIR, list.manifest ? list.manifest : "",
+                              list.length, stored_hash, existed);
+    }
+    if (!failed) {
+        printf("✓ Backed up: %s → v%d (%zu of %zu chunks new, %lld bytes written)\n",
+               job->name, version, list.new_chunks, list.chunks, list.new_bytes);
+    }
+    free(list.manifest);
+    return failed;
+}
+
+// Put the job's content into the object store. Content already present
+// costs nothing; otherwise the staged copy is moved in, or the file is
+// copied and re-hashed so an object never holds content that does not
+// match its name (the source may change while it is copied).
+// stored_hash receives the hash the object was filed under.
+int store_object(HashJob *job, char *location, unsigned char *stored_hash, int *existed) {
+    char object_path[MAX_PATH], object_dir[MAX_PATH];
+    memcpy(stored_hash, job->hash, HASH_LEN);
+    object_location(OBJECTS_DIR, stored_hash, hash_algo, location);
+    if (format_path(object_path, "%s/%s", root->backup_directory, location) != 0) {
+        fprintf(stderr, "[ERROR] Failed to store object %s: %s\n", location, strerror(errno));
+        if (job->staged) unlink(job->staged);
+        return -1;
+    }
+    
+    *existed = object_exists(object_path);
+    if (*existed) {
+        if (job->staged) unlink(job->staged);
+        return 0;
+    }
+    
+    char temp[MAX_PATH];
+    if (job->staged) {
+        strncpy(temp, job->staged, MAX_PATH - 1);
+        temp[MAX_PATH - 1] = '\0';
+    } else {
+        char filepath[MAX_PATH];
+        if (format_path(filepath, "%s/%s", root->watch_directory, job->name) != 0) {
+            fprintf(stderr, "[ERROR] Path too long: %s/%s\n", root->watch_directory, job->name);
+            return -1;
+        }
+        int fd = format_path(temp, "%s/stage_XXXXXX", root->staging_directory) == 0
+                     ? mkstemp(temp) : -1;
+        if (fd < 0) {
+            fprintf(stderr, "[ERROR] Cannot create staging file in %s: %s\n",
+                    root->staging_directory, strerror(errno));
+            return -1;
+        }
+        close(fd);
+        long long copied;
+        if (copy_to_path(filepath, temp, CODEC_NONE, &copied) != 0) {
+            return -1;
+        }
+        
+        if (calculate_hash(temp, hash_algo, stored_hash) != 0) {
+            unlink(temp);
+            return -1;
+        }
+        if (memcmp(stored_hash, job->hash, HASH_LEN) != 0) {
+            // Changed under us: file what we actually copied
+            object_location(OBJECTS_DIR, stored_hash, hash_algo, location);
+            if (format_path(object_path, "%s/%s", root->backup_directory, location) != 0) {
+                fprintf(stderr, "[ERROR] Failed to store object %s: %s\n",
+                        location, strerror(errno));
+                unlink(temp);
+                return -1;
+            }
+            *existed = object_exists(object_path);
+            if (*existed) {
+                unlink(temp);
+                return 0;
+            }
+        }
+    }
+    
+    strcpy(object_dir, object_path);
+    *strrchr(object_dir, '/') = '\0';
+    if (make_dirs(object_dir) != 0 || rename(temp, object_path) != 0) {
+        fprintf(stderr, "[ERROR] Failed to store object %s: %s\n",
+                object_path, strerror(errno));
+        unlink(temp);
+        return -1;
+    }
+    if (prune_enabled) {
+        utimensat(AT_FDCWD, object_path, NULL, 0);  // Staged copy may be older
+    }
+    return 0;
+}
+
+// Path of the version index of the tracked file name. Returns 0, or -1
+// if it does not fit (see format_path()).
+static int index_path_for(const char *name, char *path) {
+    return format_path(path, "%s/%s/%s%s", root->backup_directory, INDEX_DIR, name, INDEX_SUFFIX);
+}
+
+// Append a version record, backed up at when, to the file's index in
+// .autobackup/index. location is relative to backup_directory.
+int append_version(const char *name, int version, time_t when, const unsigned char *hash,
+                   off_t size, const char *location) {
+    char index_path[MAX_PATH], index_dir[MAX_PATH];
+    if (index_path_for(name, index_path) != 0) {
+        fprintf(stderr, "[ERROR] Cannot update the version index of %s: %s\n",
+                name, strerror(errno));
+        return -1;
+    }
+    strcpy(index_dir, index_path);
+    *strrchr(index_dir, '/') = '\0';
+    
+    FILE *f = fopen(index_path, "a");
+    if (!f && make_dirs(index_dir) == 0) {
+        f = fopen(index_path, "a");
+    }
+    if (!f) {
+        fprintf(stderr, "[ERROR] Cannot update version index %s: %s\n",
+                index_path, strerror(errno));
+        return -1;
+    }
+    
+    char hex[HASH_SIZE];
+    hash_to_hex(hash, hex);
+    hex[hash_algo_lengths[hash_algo] * 2] = '\0';
+    fprintf(f, "%d|%ld|%s|%s|%lld|%s\n", version, (long)when,
+            hash_algo_names[hash_algo], hex, (long long)size, location);
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+// Hold a version index line for the current root until sync_backups() has
+// made the backup it names durable. Safe to call from several writer
+// threads at once. Returns 0, or -1 if out of memory.
+int hold_version(const char *name, int version, const unsigned char *hash,
+                 off_t size, const char *location) {
+    HeldVersion held = { .version = version, .time = time(NULL), .size = (long long)size };
+    memcpy(held.hash, hash, HASH_LEN);
+    held.name = strdup(name);
+    held.location = strdup(location);
+    
+    pthread_mutex_lock(&held_lock);
+    if (held.name && held.location && root->held_count == root->held_capacity) {
+        size_t capacity = root->held_capacity ? root->held_capacity * 2 : 64;
+        HeldVersion *grown = realloc(root->held_versions, capacity * sizeof(HeldVersion));
+        if (grown) {
+            root->held_versions = grown;
+            root->held_capacity = capacity;
+        }
+    }
+    int failed = !held.name || !held.location || root->held_count == root->held_capacity;
+    if (!failed) {
+        root->held_versions[root->held_count++] = held;
+    }
+    pthread_mutex_unlock(&held_lock);
+    if (failed) {
+        free(held.name);
+        free(held.location);
+        return -1;
+    }
+    return 0;
+}
+
+// Size of the content stored at location (relative to backup_directory)
+// in the object store: an object's file size, or the sum of the chunk
+// lengths a manifest lists. Returns -1 if it cannot be read.
+static long long store_content_size(const char *location) {
+    char path[MAX_PATH];
+    if (format_path(path, "%s/%s", root->backup_directory, location) != 0) {
+        return -1;
+    }
+    if (strncmp(location, MANIFESTS_DIR "/", strlen(MANIFESTS_DIR) + 1) != 0) {
+        struct stat st;
+        return stat(path, &st) == 0 ? (long long)st.st_size : -1;
+    }
+    FILE *m = fopen(path, "r");
+    if (!m) {
+        return -1;
+    }
+    char line[256];
+    long long total = 0, length;
+    while (fgets(line, sizeof(line), m)) {
+        if (sscanf(line, "%*s %lld", &length) == 1) total += length;
+    }
+    fclose(m);
+    return total;
+}
+
+// Store a new version of the job's file with whichever backup mode is
+// configured and hold its version index line for the next sync. The line
+// records the size of the content actually stored, which differs from
+// the size seen at detection if the file was still being written. Consumes
+// job->staged. Safe to call from several writer threads at once.
+int commit_backup(HashJob *job, int version) {
+    char backup_path[MAX_PATH];
+    const char *location = backup_path;
+    unsigned char stored_hash[HASH_LEN];
+    long long stored_size = job->staged_size;
+    int failed;
+    int64_t started = monotonic_ns();
+    
+    // sync_backups() would retry an index line that cannot be written
+    // forever, so a name whose index path does not fit is refused here
+    char index_path[MAX_PATH];
+    if (index_path_for(job->name, index_path) != 0) {
+        fprintf(stderr, "[ERROR] Failed to create backup: %s v%d (%s)\n",
+                job->name, version, strerror(errno));
+        if (job->staged) unlink(job->staged);
+        free(job->staged);
+        job->staged = NULL;
+        METRIC_ADD(backup_failures, 1);
+        return -1;
+    }
+    
+    memcpy(stored_hash, job->hash, HASH_LEN);
+    if (!dedup && !chunked) {
+        // A plain backup is a file of its own that the pruner cannot see
+        // before its index line exists, so it is copied without the lock
+        if (job->staged) {
+            failed = publish_backup(job->staged, job->name, version, backup_path);
+        } else {
+            failed = create_backup(job->name, version, backup_path, &stored_size);
+        }
+        location = backup_path + strlen(root->backup_directory) + 1;
+        pthread_rwlock_rdlock(&store_lock);
+    } else {
+        int existed;
+        pthread_rwlock_rdlock(&store_lock);
+        if (chunked && job->st.st_size >= CHUNKED_MIN_FILE) {
+            failed = store_chunked(job, version, backup_path, stored_hash, &existed);
+        } else {
+            failed = store_object(job, backup_path, stored_hash, &existed);
+            if (!failed) {
+                printf("✓ Backed up: %s → v%d (%s)\n", job->name, version,
+                       existed ? "content already stored" : "hash changed");
+            }
+        }
+    }
+    free(job->staged);
+    job->staged = NULL;
+    
+    // Without its index line a version cannot be restored or pruned, so
+    // that counts as a failed backup (retried on the next check). Held
+    // under store_lock, the pruner sees the line or the object is newer
+    // than its gc_start.
+    if (!failed && (dedup || chunked)) {
+        stored_size = store_content_size(location);
+        failed = stored_size < 0;
+    }
+    if (!failed) {
+        failed = hold_version(job->name, version, stored_hash, (off_t)stored_size, location);
+    }
+    pthread_rwlock_unlock(&store_lock);
+    
+    int64_t elapsed = monotonic_ns() - started;
+    if (failed) {
+        METRIC_ADD(backup_failures, 1);
+        return -1;
+    }
+    METRIC_ADD(backups, 1);
+    METRIC_ADD(backup_bytes, (uint64_t)job->st.st_size);
+    histogram_observe(&metrics.backup_duration, elapsed);
+    if (bench_latencies) {
+        size_t slot = atomic_fetch_add(&bench_latency_count, 1);
+        if (slot < bench_latency_capacity) bench_latencies[slot] = elapsed;
+        atomic_fetch_add(&bench_bytes_copied, (long long)job->st.st_size);
+    }
+    return 0;
+}
+
+// Update a table entry for a new backup of the job's content
+void record_backup(FileState *fs, const HashJob *job) {
+    fs->version++;
+    fs->last_backup_ns = monotonic_ns();
+    fs->sample = job->sample;
+    memcpy(fs->hash, job->hash, HASH_LEN);
+    fs->hash_algo = hash_algo;
+    set_signature(fs, &job->st);
+}
+
+// Allocate an empty ring; capacity must be a power of two
+int ring_init(TaskRing *ring, size_t capacity) {
+    ring->cells = malloc(capacity * sizeof(RingCell));
+    if (!ring->cells) {
+        return -1;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&ring->cells[i].sequence, i);
+        ring->cells[i].item = NULL;
+    }
+    ring->mask = capacity - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return 0;
+}
+
+// Add an item, returns -1 if the ring is full
+int ring_push(TaskRing *ring, void *item) {
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (1) {
+        RingCell *cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                cell->item = item;
+                atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1;  // The cell still holds the item from one lap ago
+        } else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+}
+
+// Take the oldest item, NULL if the ring is empty
+void *ring_pop(TaskRing *ring) {
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (1) {
+        RingCell *cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                void *item = cell->item;
+                atomic_store_explicit(&cell->sequence, pos + ring->mask + 1,
+                                      memory_order_release);
+                return item;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+}
+
+// Set up the queues and start writer_count writer threads. With none
+// (or on failure) backups are written synchronously by the detector.
+int start_writers() {
+    if (writer_count <= 0) {
+        writer_count = 0;
+        return 0;
+    }
+    // Every queued or running task fits in finished_backups, so a writer
+    // never has to wait to report back
+    size_t finished_capacity = 1;
+    while (finished_capacity < 2 * BACKUP_QUEUE_SIZE + MAX_THREADS) finished_capacity *= 2;
+    if (ring_init(&small_backups, BACKUP_QUEUE_SIZE) != 0 ||
+        ring_init(&large_backups, BACKUP_QUEUE_SIZE) != 0 ||
+        ring_init(&finished_backups, finished_capacity) != 0 ||
+        pipe(wake_pipe) != 0) {
+        fprintf(stderr, "[WARN] Cannot set up backup queue, writing backups synchronously\n");
+        writer_count = 0;
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(wake_pipe[i], F_SETFL, fcntl(wake_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    
+    int started = 0;
+    for (int i = 0; i < writer_count; i++) {
+        pthread_t writer;
+        if (pthread_create(&writer, NULL, backup_writer, NULL) != 0) {
+            break;
+        }
+        pthread_detach(writer);
+        started++;
+    }
+    if (started == 0) {
+        fprintf(stderr, "[WARN] Cannot start writer threads, writing backups synchronously\n");
+    }
+    writer_count = started;
+    return 0;
+}
+
+// Hand a changed file's backup to the writers and update its table entry
+// right away, so detection moves on. Blocks while the queue is full. The
+// job's staged copy moves to the task. Returns -1 if there are no writers
+// (the caller writes the backup itself).
+int queue_backup(HashJob *job, FileState *fs) {
+    if (writer_count == 0) {
+        return -1;
+    }
+    BackupTask *task = malloc(sizeof(BackupTask));
+    if (!task) {
+        return -1;
+    }
+    task->root = root;
+    task->job = *job;
+    task->version = fs->version + 1;
+    task->failed = 0;
+    task->before = *fs;
+    job->staged = NULL;
+    record_backup(fs, job);
+    fs->in_flight = 1;
+    backups_in_flight++;
+    METRIC_SET(queue_depth, backups_in_flight);
+    
+    TaskRing *ring = job->st.st_size < SMALL_BACKUP_SIZE ? &small_backups : &large_backups;
+    while (ring_push(ring, task) != 0) {
+        // Back-pressure: wait for a writer to free a slot, collecting
+        // finished backups meanwhile
+        reap_backups();
+        pthread_mutex_lock(&queue_lock);
+        atomic_store(&detector_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (ring_push(ring, task) == 0) {
+            atomic_store(&detector_waiting, 0);
+            pthread_mutex_unlock(&queue_lock);
+            break;
+        }
+        pthread_cond_wait(&queue_space, &queue_lock);
+        atomic_store(&detector_waiting, 0);
+        pthread_mutex_unlock(&queue_lock);
+    }
+    
+    // Wake a sleeping writer. Its idle count is raised before it looks at
+    // the rings one last time, so either it sees the task or we see it.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&idle_writers) > 0) {
+        pthread_mutex_lock(&queue_lock);
+        pthread_cond_signal(&queue_work);
+        pthread_mutex_unlock(&queue_lock);
+    }
+    return 0;
+}
+
+// Wait for the next task. Small backups go first so a large copy does not
+// hold up many quick ones, but every LARGE_BACKUP_TURN-th pick prefers a
+// large one so those are not starved.
+BackupTask *next_backup_task(unsigned *turn) {
+    while (1) {
+        int large_first = ++*turn % LARGE_BACKUP_TURN == 0;
+        BackupTask *task = ring_pop(large_first ? &large_backups : &small_backups);
+        if (!task) task = ring_pop(large_first ? &small_backups : &large_backups);
+        if (task) {
+            atomic_thread_fence(memory_order_seq_cst);
+            if (atomic_load(&detector_waiting)) {
+                pthread_mutex_lock(&queue_lock);
+                pthread_cond_signal(&queue_space);
+                pthread_mutex_unlock(&queue_lock);
+            }
+            return task;
+        }
+        
+        pthread_mutex_lock(&queue_lock);
+        atomic_fetch_add(&idle_writers, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        task = ring_pop(&small_backups);
+        if (!task) task = ring_pop(&large_backups);
+        if (!task) {
+            pthread_cond_wait(&queue_work, &queue_lock);
+        }
+        atomic_fetch_sub(&idle_writers, 1);
+        pthread_mutex_unlock(&queue_lock);
+        if (task) {
+            // Went through the slow path, but the slot still needs announcing
+            atomic_thread_fence(memory_order_seq_cst);
+            if (atomic_load(&detector_waiting)) {
+                pthread_mutex_lock(&queue_lock);
+                pthread_cond_signal(&queue_space);
+                pthread_mutex_unlock(&queue_lock);
+            }
+            return task;
+        }
+    }
+}
+
+// Writer thread: write queued backups and hand them back to the detector
+void *backup_writer(void *arg) {
+    (void)arg;
+    unsigned turn = 0;
+    while (1) {
+        BackupTask *task = next_backup_task(&turn);
+        root = task->root;
+        task->failed = commit_backup(&task->job, task->version) != 0;
+        while (ring_push(&finished_backups, task) != 0) {
+            poll(NULL, 0, 1);  // Cannot happen with the ring sized as it is
+        }
+        char byte = 0;
+        if (write(wake_pipe[1], &byte, 1) < 0 && errno != EAGAIN) {
+            fprintf(stderr, "[WARN] Cannot wake detector: %s\n", strerror(errno));
+        }
+    }
+    return NULL;
+}
+
+// Collect finished backups: journal the ones that were written, put the
+// old table entry back for the ones that failed (the change is picked up
+// again on the next check), and note files that changed meanwhile
+void reap_backups() {
+    if (writer_count == 0) {
+        return;
+    }
+    char drain[64];
+    while (read(wake_pipe[0], drain, sizeof(drain)) > 0) {
+    }
+    
+    Root *current = root;
+    BackupTask *task;
+    while ((task = ring_pop(&finished_backups)) != NULL) {
+        root = task->root;
+        FileState *fs = &root->tracked_files[task->job.index];
+        fs->in_flight = 0;
+        backups_in_flight--;
+        METRIC_SET(queue_depth, backups_in_flight);
+        if (task->failed) {
+            fs->version = task->before.version;
+            fs->last_backup_ns = task->before.last_backup_ns;
+            fs->sample = task->before.sample;
+            memcpy(fs->hash, task->before.hash, HASH_LEN);
+            fs->hash_algo = task->before.hash_algo;
+            fs->mtime_ns = task->before.mtime_ns;
+            fs->ctime_ns = task->before.ctime_ns;
+            fs->size = task->before.size;
+            fs->inode = task->before.inode;
+        } else {
+            root->unsynced_backups++;
+            journal_entry(fs);
+        }
+        
+        if (fs->recheck) {
+            fs->recheck = 0;
+            if (root->recheck_count == root->recheck_capacity) {
+                size_t capacity = root->recheck_capacity ? root->recheck_capacity * 2 : 64;
+                int *grown = realloc(root->recheck_list, capacity * sizeof(int));
+                if (grown) {
+                    root->recheck_list = grown;
+                    root->recheck_capacity = capacity;
+                }
+            }
+            if (root->recheck_count < root->recheck_capacity) {
+                root->recheck_list[root->recheck_count++] = task->job.index;
+            }
+        }
+        free(task);
+    }
+    for (int i = 0; i < root_count; i++) {
+        root = &roots[i];
+        journal_commit();
+    }
+    root = current;
+}
+
+// Collect finished backups, make journal commits held back for a sync
+// (see journal_commit()) once they are due, and check the files that
+// changed while their backup was in flight. Called from the main loops,
+// never from inside check_files().
+void finish_backups() {
+    reap_backups();
+    Root *current = root;
+    for (int i = 0; i < root_count; i++) {
+        root = &roots[i];
+        journal_commit();
+        if (root->recheck_count == 0) {
+            continue;
+        }
+        int *indices = root->recheck_list;
+        size_t count = root->recheck_count;
+        root->recheck_list = NULL;
+        root->recheck_count = 0;
+        root->recheck_capacity = 0;
+        check_files(indices, count, 1);
+        free(indices);
+    }
+    root = current;
+}
+
+// SIGINT/SIGTERM: ask the main loop to stop_watching() and wake it.
+// Repeats are harmless (timeout(1) signals both the process and its group).
+static void request_stop(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    char byte = 0;
+    stop_requested = 1;
+    if (wake_pipe[1] >= 0 && write(wake_pipe[1], &byte, 1) < 0) {
+        // Full already, the main loop is woken anyway
+    }
+    errno = saved_errno;
+}
+
+// Catch SIGINT and SIGTERM. Without writers the wake pipe is created
+// here, so a signal taken by another thread still wakes the main loop.
+void install_stop_handler() {
+    if (wake_pipe[0] < 0 && pipe(wake_pipe) == 0) {
+        for (int i = 0; i < 2; i++) {
+            fcntl(wake_pipe[i], F_SETFL, fcntl(wake_pipe[i], F_GETFL) | O_NONBLOCK);
+            fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC);
+        }
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+// Stop after a SIGINT or SIGTERM: let the writers finish the queued
+// backups, then commit every root's held index lines and journal records
+// without waiting out --sync-interval, so the next run neither repeats
+// those backups nor reuses their version numbers. Does not return.
+void stop_watching() {
+    if (backups_in_flight > 0) {
+        printf("[AutoBackup] Stopping, finishing %d queued backup(s)...\n", backups_in_flight);
+    }
+    while (backups_in_flight > 0) {
+        struct pollfd wake = { .fd = wake_pipe[0], .events = POLLIN };
+        poll(&wake, 1, 100);
+        reap_backups();
+    }
+    int failed = 0;
+    for (int i = 0; i < root_count; i++) {
+        root = &roots[i];
+        journal_commit();
+        if (root->journal_dirty) {
+            fprintf(stderr, "[ERROR] Could not commit the state of %s\n", root->watch_directory);
+            failed = 1;
+        }
+    }
+    printf("[AutoBackup] Stopped\n");
+    exit(failed ? 1 : 0);
+}
+
+// Remove staging files left behind by an interrupted run
+void clean_staging() {
+    DIR *dir = opendir(root->staging_directory);
+    if (!dir) {
+        return;
+    }
+    
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "stage_", 6) == 0) {
+            unlinkat(dirfd(dir), entry->d_name, 0);
+        }
+    }
+    closedir(dir);
+}
+
+// Start tracking newly discovered files, hashing them in parallel.
+// Names already in the table (duplicate events) are skipped.
+void track_files(FoundFile *found, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    
+    HashJob *jobs = calloc(count, sizeof(HashJob));
+    if (!jobs) {
+        fprintf(stderr, "[ERROR] Out of memory hashing new files\n");
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        jobs[i].index = -1;
+        jobs[i].name = found[i].name;
+        jobs[i].st = found[i].st;
+        jobs[i].algo = hash_algo;
+    }
+    hash_jobs(jobs, count);
+    
+    for (size_t i = 0; i < count; i++) {
+        if (find_file(jobs[i].name) >= 0) {
+            continue;
+        }
+        FileState *fs = append_file(jobs[i].name);
+        // An unreadable file keeps an all-zero hash so its first read backs it up
+        if (jobs[i].status == 0) {
+            memcpy(fs->hash, jobs[i].hash, HASH_LEN);
+        }
+        fs->hash_algo = hash_algo;
+        set_signature(fs, &jobs[i].st);
+        fs->sample = jobs[i].sample;
+        fs->version = 1;
+        journal_entry(fs);
+        printf("[AutoBackup] Now tracking: %s\n", jobs[i].name);
+    }
+    free(jobs);
+    journal_commit();
+}
+
+// Number of worker threads to use when none is configured
+int default_threads() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > MAX_THREADS) n = MAX_THREADS;
+    return (int)n;
+}
+
+// Read one directory: queue subdirectories (recursive mode) and record
+// regular files that are not tracked yet. Takes ownership of dir.
+void walk_directory(WalkWorker *worker, char *dir) {
+    WalkQueue *queue = worker->queue;
+    
+    int fd = openat(queue->root_fd, dir[0] ? dir : ".",
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!d) {
+        fprintf(stderr, "[ERROR] Cannot open directory: %s/%s\n", root->watch_directory, dir);
+        if (fd >= 0) close(fd);
+        free(dir);
+        return;
+    }
+    add_watch(dir);
+    
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        // Skip hidden files and directories (including .autobackup)
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        
+        char path[MAX_PATH];
+        if (format_path(path, "%s%s%s", dir, dir[0] ? "/" : "", entry->d_name) != 0) {
+            fprintf(stderr, "[WARN] Skipping %s/%s/%s: path too long\n",
+                    root->watch_directory, dir, entry->d_name);
+            continue;
+        }
+        
+        // Sockets, fifos and devices are never tracked; d_type tells us
+        // without a stat on most filesystems
+        if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_DIR &&
+            entry->d_type != DT_REG && entry->d_type != DT_LNK) {
+            continue;
+        }
+        int is_dir = entry->d_type == DT_DIR;
+        struct stat file_stat;
+        if (entry->d_type == DT_UNKNOWN) {
+            if (fstatat(fd, entry->d_name, &file_stat, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+            is_dir = S_ISDIR(file_stat.st_mode);
+        }
+        // An excluded directory is never opened, so nothing below it is
+        // read or stat'ed
+        if (ignored(path, is_dir)) {
+            continue;
+        }
+        
+        if (is_dir) {
+            if (recursive) {
+                char *child = strdup(path);
+                pthread_mutex_lock(&queue->lock);
+                if (child && queue->count == queue->capacity) {
+                    size_t capacity = queue->capacity ? queue->capacity * 2 : 64;
+                    char **grown = realloc(queue->dirs, capacity * sizeof(char *));
+                    if (grown) {
+                        queue->dirs = grown;
+                        queue->capacity = capacity;
+                    }
+                }
+                if (child && queue->count < queue->capacity) {
+                    queue->dirs[queue->count++] = child;
+                    pthread_cond_signal(&queue->cond);
+                } else {
+                    free(child);
+                    queue->failed = 1;
+                }
+                pthread_mutex_unlock(&queue->lock);
+            }
+            continue;
+        }
+        
+        // The table's layout is fixed while a walk is running, so this is
+        // safe. A tracked file under a new inode was replaced by rename
+        // (how many editors save): poll it on the next check even if its
+        // poll interval has backed off. Each file is seen by one walker.
+        int index = find_file(path);
+        if (index >= 0) {
+            if (entry->d_type == DT_REG && entry->d_ino != root->tracked_files[index].inode) {
+                root->tracked_files[index].next_poll_ns = 0;
+            }
+            continue;
+        }
+        METRIC_ADD(files_statted, 1);
+        if (stat_at(fd, entry->d_name, &file_stat) != 0 || !S_ISREG(file_stat.st_mode) ||
+            (max_file_size && file_stat.st_size > max_file_size)) {
+            continue;
+        }
+        
+        if (worker->count == worker->capacity) {
+            size_t capacity = worker->capacity ? worker->capacity * 2 : 256;
+            FoundFile *grown = realloc(worker->found, capacity * sizeof(FoundFile));
+            if (grown) {
+                worker->found = grown;
+                worker->capacity = capacity;
+            }
+        }
+        char *copy = worker->count < worker->capacity ? strdup(path) : NULL;
+        if (!copy) {
+            pthread_mutex_lock(&queue->lock);
+            queue->failed = 1;
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        worker->found[worker->count].name = copy;
+        worker->found[worker->count].st = file_stat;
+        worker->count++;
+    }
+    
+    closedir(d);
+    free(dir);
+}
+
+// Walker thread: pull directories until the queue is drained and idle
+void *walk_worker(void *arg) {
+    WalkWorker *worker = arg;
+    WalkQueue *queue = worker->queue;
+    root = queue->root;
+    
+    pthread_mutex_lock(&queue->lock);
+    while (1) {
+        while (queue->count == 0 && queue->active > 0) {
+            pthread_cond_wait(&queue->cond, &queue->lock);
+        }
+        if (queue->count == 0) {
+            break;
+        }
+        
+        char *dir = queue->dirs[--queue->count];
+        queue->active++;
+        pthread_mutex_unlock(&queue->lock);
+        
+        walk_directory(worker, dir);
+        
+        pthread_mutex_lock(&queue->lock);
+        queue->active--;
+        if (queue->count == 0 && queue->active == 0) {
+            pthread_cond_broadcast(&queue->cond);
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+// Walk the tree below start ("" for the watch directory itself) and
+// start tracking every new file found. Returns 0, or -1 if the walk ran
+// out of memory (the files it did find are still tracked).
+int walk_tree(const char *start) {
+    int64_t started = monotonic_ns();
+    WalkQueue queue = {0};
+    queue.root = root;
+    queue.root_fd = open(root->watch_directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (queue.root_fd < 0) {
+        fprintf(stderr, "[ERROR] Cannot open directory: %s\n", root->watch_directory);
+        return -1;
+    }
+    queue.capacity = 64;
+    queue.dirs = malloc(queue.capacity * sizeof(char *));
+    char *first = strdup(start);
+    if (!queue.dirs || !first) {
+        fprintf(stderr, "[ERROR] Out of memory scanning %s\n", root->watch_directory);
+        free(queue.dirs);
+        free(first);
+        close(queue.root_fd);
+        return -1;
+    }
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.cond, NULL);
+    queue.dirs[queue.count++] = first;
+    
+    // Only one directory to read without recursion, so skip the threads
+    int threads = recursive ? worker_threads : 1;
+    WalkWorker workers[MAX_THREADS];
+    memset(workers, 0, sizeof(workers));
+    for (int i = 0; i < threads; i++) {
+        workers[i].queue = &queue;
+    }
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, walk_worker, &workers[i]) != 0) {
+            threads = i;
+            break;
+        }
+    }
+    walk_worker(&workers[0]);
+    for (int i = 1; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    
+    // Single-threaded merge into the file table
+    for (int i = 0; i < threads; i++) {
+        track_files(workers[i].found, workers[i].count);
+        for (size_t j = 0; j < workers[i].count; j++) {
+            free(workers[i].found[j].name);
+        }
+        free(workers[i].found);
+    }
+    
+    free(queue.dirs);
+    pthread_mutex_destroy(&queue.lock);
+    pthread_cond_destroy(&queue.cond);
+    close(queue.root_fd);
+    histogram_observe(&metrics.scan_duration, monotonic_ns() - started);
+    update_gauges();
+    if (queue.failed) {
+        fprintf(stderr, "[ERROR] Out of memory scanning %s\n", root->watch_directory);
+        return -1;
+    }
+    return 0;
+}
+
+// Scan directory and update file tracking. Returns 0, or -1 if the scan
+// is incomplete.
+int scan_directory() {
+    return walk_tree("");
+}
+
+// Compare ints for qsort
+static int compare_ints(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Current CLOCK_MONOTONIC time in nanoseconds
+int64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return TIMESPEC_NS(ts);
+}
+
+// Swap two pending heap slots, keeping the files' slot numbers in sync
+static void pending_swap(size_t a, size_t b) {
+    PendingCheck tmp = root->pending[a];
+    root->pending[a] = root->pending[b];
+    root->pending[b] = tmp;
+    root->tracked_files[root->pending[a].index].pending = (int)a + 1;
+    root->tracked_files[root->pending[b].index].pending = (int)b + 1;
+}
+
+// Restore heap order after the due time in slot changed
+void pending_sift(size_t slot) {
+    while (slot > 0 && root->pending[slot].due < root->pending[(slot - 1) / 2].due) {
+        pending_swap(slot, (slot - 1) / 2);
+        slot = (slot - 1) / 2;
+    }
+    while (1) {
+        size_t smallest = slot, left = slot * 2 + 1, right = left + 1;
+        if (left < root->pending_count && root->pending[left].due < root->pending[smallest].due) smallest = left;
+        if (right < root->pending_count && root->pending[right].due < root->pending[smallest].due) smallest = right;
+        if (smallest == slot) break;
+        pending_swap(slot, smallest);
+        slot = smallest;
+    }
+}
+
+// Drop a pending check
+void pending_remove(size_t slot) {
+    root->tracked_files[root->pending[slot].index].pending = 0;
+    root->pending_count--;
+    if (slot < root->pending_count) {
+        root->pending[slot] = root->pending[root->pending_count];
+        root->tracked_files[root->pending[slot].index].pending = (int)slot + 1;
+        pending_sift(slot);
+    }
+}
+
+// Decide whether a changed file is checked now or once it has been stable
+// for the debounce period and its rate limit allows another backup.
+// Returns 1 if the check was deferred, 0 if the caller should go ahead.
+int defer_check(int index, const struct stat *st) {
+    if (debounce_ms <= 0 && rate_limit_seconds <= 0) {
+        return 0;
+    }
+    
+    FileState *fs = &root->tracked_files[index];
+    int64_t now = monotonic_ns();
+    if (!fs->pending) {
+        if (root->pending_count == root->pending_capacity) {
+            size_t capacity = root->pending_capacity ? root->pending_capacity * 2 : 64;
+            PendingCheck *grown = realloc(root->pending, capacity * sizeof(PendingCheck));
+            if (!grown) {
+                return 0;  // Check right away rather than lose the change
+            }
+            root->pending = grown;
+            root->pending_capacity = capacity;
+        }
+        root->pending[root->pending_count].index = index;
+        root->pending[root->pending_count].stable_since = -1;
+        fs->pending = (int)++root->pending_count;
+    }
+    
+    // Any change since the file was last seen restarts the quiet period
+    PendingCheck *p = &root->pending[fs->pending - 1];
+    if (p->stable_since < 0 ||
+        p->mtime_ns != TIMESPEC_NS(ST_MTIM(st)) ||
+        p->ctime_ns != TIMESPEC_NS(ST_CTIM(st)) ||
+        p->size != (uint64_t)st->st_size) {
+        p->stable_since = now;
+        p->mtime_ns = TIMESPEC_NS(ST_MTIM(st));
+        p->ctime_ns = TIMESPEC_NS(ST_CTIM(st));
+        p->size = (uint64_t)st->st_size;
+    }
+    
+    int64_t due = p->stable_since + (int64_t)debounce_ms * 1000000;
+    if (rate_limit_seconds > 0 && fs->last_backup_ns > 0) {
+        int64_t allowed = fs->last_backup_ns + (int64_t)rate_limit_seconds * 1000000000;
+        if (allowed > due) due = allowed;
+    }
+    if (due <= now) {
+        pending_remove(fs->pending - 1);
+        return 0;
+    }
+    p->due = due;
+    pending_sift(fs->pending - 1);
+    return 1;
+}
+
+// Milliseconds until the earliest pending check or held journal commit
+// of any root is due, -1 if none
+int next_due_timeout() {
+    int64_t earliest = INT64_MAX;
+    for (int i = 0; i < root_count; i++) {
+        if (roots[i].pending_count > 0 && roots[i].pending[0].due < earliest) {
+            earliest = roots[i].pending[0].due;
+        }
+        if (roots[i].journal_dirty && roots[i].unsynced_backups > 0) {
+            int64_t commit = roots[i].synced_ns + (int64_t)sync_interval_ms * 1000000;
+            if (commit < earliest) earliest = commit;
+        }
+    }
+    if (earliest == INT64_MAX) {
+        return -1;
+    }
+    int64_t wait = earliest - monotonic_ns();
+    if (wait <= 0) {
+        return 0;
+    }
+    wait = (wait + 999999) / 1000000;
+    return wait > INT_MAX ? INT_MAX : (int)wait;
+}
+
+// Check every pending file whose due time has passed, root by root.
+// Files that changed again in the meantime are pushed back by
+// defer_check().
+void run_due_checks() {
+    Root *current = root;
+    for (int r = 0; r < root_count; r++) {
+        root = &roots[r];
+        if (root->pending_count == 0) {
+            continue;
+        }
+        
+        int *due = malloc(root->pending_count * sizeof(int));
+        if (!due) {
+            fprintf(stderr, "[ERROR] Out of memory checking for changes\n");
+            break;
+        }
+        int64_t now = monotonic_ns();
+        size_t count = 0;
+        for (size_t i = 0; i < root->pending_count; i++) {
+            if (root->pending[i].due <= now) {
+                due[count++] = root->pending[i].index;
+            }
+        }
+        check_files(due, count, 1);
+        free(due);
+    }
+    root = current;
+}
+
+// Adapt a file's polling rate to its change history: each poll that finds
+// it unchanged doubles its interval, up to max_poll_interval, and a
+// change brings it back to poll_interval
+void update_poll_schedule(FileState *fs, int changed) {
+    if (changed) {
+        fs->poll_level = 0;
+    } else if (fs->poll_level < 30 &&
+               ((int64_t)poll_interval << fs->poll_level) < max_poll_interval) {
+        fs->poll_level++;
+    }
+    int64_t interval = (int64_t)poll_interval << fs->poll_level;
+    if (interval > max_poll_interval) interval = max_poll_interval;
+    if (interval < poll_interval) interval = poll_interval;
+    fs->next_poll_ns = monotonic_ns() + interval * 1000000000;
+}
+
+// Check tracked files and back up those whose content changed.
+// Candidates are stat'ed here, hashed in parallel, then compared in
+// order by this thread, which queues the backups for the writers. force
+// skips the mtime shortcut, used when the kernel already told us the
+// files were written (same-second writes keep the old mtime). Changed
+// files still inside their debounce period or rate limit are left for
+// run_due_checks(). indices may be reordered.
+void check_files(int *indices, size_t count, int force) {
+    if (count == 0) {
+        return;
+    }
+    
+    int64_t started = monotonic_ns();
+    HashJob *jobs = calloc(count, sizeof(HashJob));
+    if (!jobs) {
+        fprintf(stderr, "[ERROR] Out of memory checking for changes\n");
+        return;
+    }
+    
+    // Stage 1: stat all files in one go (duplicates collapse after
+    // sorting), then keep the candidates
+    qsort(indices, count, sizeof(int), compare_ints);
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0 && indices[i] == indices[i - 1]) {
+            continue;
+        }
+        jobs[unique].index = indices[i];
+        jobs[unique].name = root->tracked_files[indices[i]].filename;
+        unique++;
+    }
+    stat_jobs(jobs, unique);
+    
+    size_t candidates = 0;
+    for (size_t i = 0; i < unique; i++) {
+        FileState *fs = &root->tracked_files[jobs[i].index];
+        HashJob *job = &jobs[candidates];
+        if (candidates != i) {
+            *job = jobs[i];
+        }
+        
+        if (job->status != 0 || (max_file_size && job->st.st_size > max_file_size)) {
+            // File deleted, inaccessible or grown past --max-file-size
+            if (fs->pending) {
+                pending_remove(fs->pending - 1);
+            }
+            update_poll_schedule(fs, 0);
+            continue;
+        }
+        
+        // Skip files whose stat signature is unchanged since the last hash
+        int unchanged = signature_matches(fs, &job->st);
+        update_poll_schedule(fs, !unchanged);
+        if (fs->in_flight) {
+            // One backup per file at a time keeps its versions in order;
+            // look again once the one in flight is written
+            if (force || !unchanged) fs->recheck = 1;
+            continue;
+        }
+        if (!force && unchanged) {
+            continue;
+        }
+        if (defer_check(job->index, &job->st)) {
+            METRIC_ADD(checks_deferred, 1);
+            continue;
+        }
+        
+        job->algo = fs->hash_algo;
+        job->staged = NULL;
+        job->prev_sample = fs->sample;
+        if (fs->inode != 0 && (uint64_t)job->st.st_size != fs->size) {
+            // A new size proves a change: no need to also hash with the old
+            // algorithm for the comparison
+            job->algo = hash_algo;
+        } else if (sample_large && fs->sample && job->st.st_size >= SAMPLE_MIN_SIZE) {
+            job->sample_first = 1;
+        }
+        candidates++;
+    }
+    
+    // Stage 2: hash in parallel
+    hash_jobs(jobs, candidates);
+    
+    // Stage 3: single writer compares, backs up and updates the table
+    for (size_t i = 0; i < candidates; i++) {
+        HashJob *job = &jobs[i];
+        FileState *fs = &root->tracked_files[job->index];
+        
+        if (job->status != 0) {
+            continue;
+        }
+        if (job->skip) {
+            // Sampled fingerprint matched: only the metadata changed
+            set_signature(fs, &job->st);
+            journal_entry(fs);
+            continue;
+        }
+        
+        // Compare hashes (detects actual content changes)
+        if (memcmp(job->prev_hash, fs->hash, HASH_LEN) == 0) {
+            fs->sample = job->sample;
+            if (job->staged) {
+                unlink(job->staged);
+                free(job->staged);
+            }
+            // Unchanged: record the new signature (so a touched file is not
+            // re-hashed on every check) and move the entry over to the
+            // configured algorithm
+            if (!signature_matches(fs, &job->st) || fs->hash_algo != hash_algo) {
+                memcpy(fs->hash, job->hash, HASH_LEN);
+                fs->hash_algo = hash_algo;
+                set_signature(fs, &job->st);
+                journal_entry(fs);
+            }
+            continue;
+        }
+        
+        // Content changed - queue the backup for the writers, or write it
+        // here without them; on failure keep the old state so the change
+        // is picked up again on the next check
+        if (queue_backup(job, fs) == 0) {
+            continue;
+        }
+        if (commit_backup(job, fs->version + 1) != 0) {
+            continue;
+        }
+        record_backup(fs, job);
+        root->unsynced_backups++;
+        journal_entry(fs);
+    }
+    free(jobs);
+    
+    journal_commit();
+    histogram_observe(&metrics.check_duration, monotonic_ns() - started);
+    update_gauges();
+}
+
+// Check for file changes and create backups
+void check_for_changes() {
+    if (root->file_count == 0) {
+        return;
+    }
+    
+    int *indices = malloc(root->file_count * sizeof(int));
+    if (!indices) {
+        fprintf(stderr, "[ERROR] Out of memory checking for changes\n");
+        return;
+    }
+    for (int i = 0; i < root->file_count; i++) {
+        indices[i] = i;
+    }
+    check_files(indices, root->file_count, 0);
+    free(indices);
+}
+
+// Polling mode: check only the files whose adaptive poll interval is up.
+// Files due within half a poll interval are taken now rather than a whole
+// interval late.
+void poll_for_changes() {
+    if (root->file_count == 0) {
+        return;
+    }
+    
+    int *indices = malloc(root->file_count * sizeof(int));
+    if (!indices) {
+        fprintf(stderr, "[ERROR] Out of memory checking for changes\n");
+        return;
+    }
+    int64_t horizon = monotonic_ns() + (int64_t)poll_interval * 500000000;
+    size_t count = 0;
+    for (int i = 0; i < root->file_count; i++) {
+        if (root->tracked_files[i].next_poll_ns <= horizon) {
+            indices[count++] = i;
+        }
+    }
+    check_files(indices, count, 0);
+    free(indices);
+}
+
+// Check that a stored object exists. While pruning is enabled this also
+// sets its mtime to now, which tells a concurrent garbage collection run
+// that the object is in use even before its version is recorded.
+int object_exists(const char *path) {
+    if (prune_enabled && utimensat(AT_FDCWD, path, NULL, 0) == 0) {
+        return 1;
+    }
+    return access(path, F_OK) == 0;
+}
+
+// Parse a byte count with an optional K, M, G or T suffix, -1 if invalid
+long long parse_size(const char *text) {
+    char *end;
+    long long value = strtoll(text, &end, 10);
+    if (end == text || value < 0) {
+        return -1;
+    }
+    switch (toupper((unsigned char)*end)) {
+    case 'T': value *= 1024;  // Fall through
+    case 'G': value *= 1024;  // Fall through
+    case 'M': value *= 1024;  // Fall through
+    case 'K': value *= 1024; end++; break;
+    case '\0': break;
+    default: return -1;
+    }
+    return *end == '\0' || toupper((unsigned char)*end) == 'B' ? value : -1;
+}
+
+// Add a location to a set, returns 1 if it was new
+int location_set_add(LocationSet *set, const char *location) {
+    if ((set->count + 1) * 2 > set->capacity) {
+        size_t capacity = set->capacity ? set->capacity * 2 : 1024;
+        char **slots = calloc(capacity, sizeof(char *));
+        if (!slots) {
+            return -1;
+        }
+        for (size_t i = 0; i < set->capacity; i++) {
+            if (!set->slots[i]) continue;
+            size_t j = hash_name(set->slots[i]) & (capacity - 1);
+            while (slots[j]) j = (j + 1) & (capacity - 1);
+            slots[j] = set->slots[i];
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->capacity = capacity;
+    }
+    size_t i = hash_name(location) & (set->capacity - 1);
+    while (set->slots[i]) {
+        if (strcmp(set->slots[i], location) == 0) return 0;
+        i = (i + 1) & (set->capacity - 1);
+    }
+    set->slots[i] = strdup(location);
+    set->count++;
+    return 1;
+}
+
+// Is the location in the set?
+int location_set_has(const LocationSet *set, const char *location) {
+    if (set->capacity == 0) {
+        return 0;
+    }
+    size_t i = hash_name(location) & (set->capacity - 1);
+    while (set->slots[i]) {
+        if (strcmp(set->slots[i], location) == 0) return 1;
+        i = (i + 1) & (set->capacity - 1);
+    }
+    return 0;
+}
+
+void location_set_free(LocationSet *set) {
+    for (size_t i = 0; i < set->capacity; i++) {
+        free(set->slots[i]);
+    }
+    free(set->slots);
+    memset(set, 0, sizeof(*set));
+}
+
+// Add every "*.versions" file below dir (relative to the index directory)
+// to the list. Returns 0, or -1 if out of memory (the list holds what was
+// added so far).
+int collect_index_files(const char *dir, char ***list, size_t *count, size_t *capacity) {
+    char path[MAX_PATH];
+    DIR *d = format_path(path, "%s/%s/%s", root->backup_directory, INDEX_DIR, dir) == 0
+                 ? opendir(path) : NULL;
+    if (!d) {
+        return 0;
+    }
+    
+    int failed = 0;
+    
+    struct dirent *entry;
+    while (!failed && (entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char child[MAX_PATH];
+        if (format_path(child, "%s%s%s", dir, dir[0] ? "/" : "", entry->d_name) != 0) {
+            continue;
+        }
+        
+        int is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = fstatat(dirfd(d), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                     S_ISDIR(st.st_mode);
+        }
+        if (is_dir) {
+            failed = collect_index_files(child, list, count, capacity);
+            continue;
+        }
+        
+        size_t len = strlen(child), suffix = strlen(INDEX_SUFFIX);
+        if (len <= suffix || strcmp(child + len - suffix, INDEX_SUFFIX) != 0) {
+            continue;
+        }
+        if (*count == *capacity) {
+            size_t grown_capacity = *capacity ? *capacity * 2 : 256;
+            char **grown = realloc(*list, grown_capacity * sizeof(char *));
+            if (!grown) {
+                failed = -1;
+                break;
+            }
+            *list = grown;
+            *capacity = grown_capacity;
+        }
+        char *copy = strdup(child);
+        if (!copy) {
+            failed = -1;
+            break;
+        }
+        (*list)[(*count)++] = copy;
+    }
+    closedir(d);
+    return failed;
+}
+
+// Parse a "version|time|algo|hash|size|location" index line (the trailing
+// newline already removed). Returns -1 if it is malformed.
+int parse_version_line(char *line, VersionRecord *record) {
+    char *fields[6];
+    char *p = line;
+    for (int i = 0; i < 5; i++) {
+        fields[i] = p;
+        if (!(p = strchr(p, '|'))) return -1;
+        *p++ = '\0';
+    }
+    fields[5] = p;
+    record->version = atoi(fields[0]);
+    record->time = (time_t)atoll(fields[1]);
+    record->size = atoll(fields[4]);
+    record->hash = fields[3];
+    record->location = fields[5];
+    record->keep = 0;
+    return record->version > 0 && fields[5][0] ? 0 : -1;
+}
+
+// Keep the newest version of each of the newest `buckets` time periods,
+// periods being told apart by their strftime(format) key. records are
+// sorted newest first.
+void keep_buckets(VersionRecord *records, size_t count, int buckets, const char *format) {
+    char last[32] = "", key[32];
+    for (size_t i = 0; i < count && buckets > 0; i++) {
+        struct tm tm;
+        localtime_r(&records[i].time, &tm);
+        strftime(key, sizeof(key), format, &tm);
+        if (strcmp(key, last) != 0) {
+            records[i].keep = 1;
+            buckets--;
+            strcpy(last, key);
+        }
+    }
+}
+
+// Sort version records newest first
+static int compare_versions_desc(const void *a, const void *b) {
+    const VersionRecord *x = a, *y = b;
+    return (y->version > x->version) - (y->version < x->version);
+}
+
+// Sort version records oldest first by backup time
+static int compare_record_ptrs_by_time(const void *a, const void *b) {
+    const VersionRecord *x = *(VersionRecord * const *)a, *y = *(VersionRecord * const *)b;
+    if (x->time != y->time) return (x->time > y->time) - (x->time < y->time);
+    return (x->version > y->version) - (x->version < y->version);
+}
+
+// Is the version stored in the shared object store rather than as a file
+// of its own?
+static int in_shared_store(const VersionRecord *record) {
+    return strncmp(record->location, OBJECTS_DIR "/", strlen(OBJECTS_DIR) + 1) == 0 ||
+           strncmp(record->location, MANIFESTS_DIR "/", strlen(MANIFESTS_DIR) + 1) == 0;
+}
+
+// Bytes a version takes in the backup directory: a plain backup's file
+// size, which is smaller than the recorded original when it is compressed.
+// Shared-store versions and missing files count at their original size.
+static long long stored_size(const VersionRecord *record) {
+    if (in_shared_store(record)) {
+        return record->size;
+    }
+    char path[MAX_PATH];
+    struct stat st;
+    if (format_path(path, "%s/%s", root->backup_directory, record->location) != 0) {
+        return record->size;
+    }
+    return stat(path, &st) == 0 ? (long long)st.st_size : record->size;
+}
+
+// Sort version record pointers by location
+static int compare_record_ptrs_by_location(const void *a, const void *b) {
+    const VersionRecord *x = *(VersionRecord * const *)a, *y = *(VersionRecord * const *)b;
+    return strcmp(x->location, y->location);
+}
+
+// Rewrite an index file without the versions marked in drop (a sorted
+// list of version numbers). Holds store_lock so no version is appended
+// meanwhile. Returns 0 on success.
+int rewrite_index(const char *index_name, const int *drop, size_t drop_count) {
+    char path[MAX_PATH], temp[MAX_PATH];
+    if (format_path(path, "%s/%s/%s", root->backup_directory, INDEX_DIR, index_name) != 0 ||
+        format_path(temp, "%s.prune", path) != 0) {
+        return -1;
+    }
+    
+    pthread_rwlock_wrlock(&store_lock);
+    FILE *in = fopen(path, "r");
+    FILE *out = in ? fopen(temp, "w") : NULL;
+    int failed = !out;
+    char line[MAX_PATH + 256];
+    while (!failed && fgets(line, sizeof(line), in)) {
+        int version = atoi(line);
+        if (bsearch(&version, drop, drop_count, sizeof(int), compare_ints)) {
+            continue;
+        }
+        if (fputs(line, out) == EOF) failed = 1;
+    }
+    if (in) fclose(in);
+    if (out && fclose(out) != 0) failed = 1;
+    if (!failed && rename(temp, path) != 0) failed = 1;
+    if (failed && out) unlink(temp);
+    pthread_rwlock_unlock(&store_lock);
+    return failed ? -1 : 0;
+}
+
+// Apply the retention rules to one file's versions (sorted newest first).
+// The newest version is always kept.
+void apply_retention(VersionRecord *records, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    int rules = keep_last || keep_hourly || keep_daily || keep_weekly;
+    for (size_t i = 0; i < count; i++) {
+        records[i].keep = !rules || (int)i < keep_last;
+    }
+    keep_buckets(records, count, keep_hourly, "%Y%m%d%H");
+    keep_buckets(records, count, keep_daily, "%Y%m%d");
+    keep_buckets(records, count, keep_weekly, "%G%V");
+    records[0].keep = 1;
+}
+
+// Remove content-addressed objects and manifests no index line refers to.
+// Objects touched since gc_start (see object_exists()) are in use by a
+// backup that may not be recorded yet and are left alone. Each removal
+// happens under store_lock after re-checking the object, so it cannot
+// race with a backup reusing it. Returns the number of bytes freed.
+long long collect_garbage(time_t gc_start, char **index_files, size_t index_count) {
+    LocationSet live = {0};
+    long long freed = 0;
+    
+    // Mark: every stored location named by an index line or held for one.
+    // Held lines are taken first: one flushed meanwhile is in its index by
+    // the time that is read, and one held later was stored after gc_start
+    pthread_mutex_lock(&held_lock);
+    for (size_t i = 0; i < root->held_count; i++) {
+        location_set_add(&live, root->held_versions[i].location);
+    }
+    pthread_mutex_unlock(&held_lock);
+    for (size_t i = 0; i < index_count; i++) {
+        char path[MAX_PATH], line[MAX_PATH + 256];
+        if (format_path(path, "%s/%s/%s", root->backup_directory, INDEX_DIR, index_files[i]) != 0) {
+            // Its objects would look unused
+            fprintf(stderr, "[ERROR] Index path too long for %s, not collecting garbage\n",
+                    index_files[i]);
+            location_set_free(&live);
+            return 0;
+        }
+        FILE *f = fopen(path, "r");
+        if (!f) continue;
+        while (fgets(line, sizeof(line), f)) {
+            VersionRecord record;
+            line[strcspn(line, "\n")] = '\0';
+            if (parse_version_line(line, &record) == 0) {
+                location_set_add(&live, record.location);
+            }
+        }
+        fclose(f);
+    }
+    
+    // Sweep manifests first; chunks of every manifest that stays are live
+    const char *stores[2] = { MANIFESTS_DIR, OBJECTS_DIR };
+    for (int s = 0; s < 2; s++) {
+        char store_path[MAX_PATH];
+        DIR *store = format_path(store_path, "%s/%s", root->backup_directory, stores[s]) == 0
+                         ? opendir(store_path) : NULL;
+        if (!store) continue;
+        
+        struct dirent *fanout;
+        while ((fanout = readdir(store)) != NULL) {
+            if (fanout->d_name[0] == '.') continue;
+            char dir_path[MAX_PATH];
+            DIR *d = format_path(dir_path, "%s/%s", store_path, fanout->d_name) == 0
+                         ? opendir(dir_path) : NULL;
+            if (!d) continue;
+            
+            struct dirent *entry;
+            while ((entry = readdir(d)) != NULL) {
+                if (entry->d_name[0] == '.') continue;
+                char location[MAX_PATH], path[MAX_PATH];
+                if (format_path(location, "%s/%s/%s", stores[s], fanout->d_name, entry->d_name) != 0 ||
+                    format_path(path, "%s/%s", root->backup_directory, location) != 0) {
+                    continue;  // Not one of ours, left alone
+                }
+                
+                struct stat st;
+                int keep = location_set_has(&live, location);
+                if (!keep) {
+                    pthread_rwlock_wrlock(&store_lock);
+                    keep = stat(path, &st) != 0 || st.st_mtime >= gc_start;
+                    if (!keep && unlink(path) == 0) {
+                        freed += (long long)st.st_size;
+                    }
+                    pthread_rwlock_unlock(&store_lock);
+                }
+                if (!keep || s != 0) continue;
+                
+                // Surviving manifest: mark its chunks
+                FILE *m = fopen(path, "r");
+                char line[256], hex[HASH_SIZE], chunk[MAX_PATH];
+                while (m && fgets(line, sizeof(line), m)) {
+                    if (sscanf(line, "%64s", hex) == 1 && strlen(hex) > 2 &&
+                        format_path(chunk, "%s/%.2s/%s", OBJECTS_DIR, hex, hex + 2) == 0) {
+                        location_set_add(&live, chunk);
+                    }
+                }
+                if (m) fclose(m);
+            }
+            closedir(d);
+        }
+        closedir(store);
+    }
+    
+    location_set_free(&live);
+    return freed;
+}
+
+// One pruning pass over every file's version index in the current root
+void prune_backups() {
+    // Wait out any backup in progress: everything stored from now on has
+    // a newer mtime than gc_start
+    pthread_rwlock_wrlock(&store_lock);
+    time_t gc_start = time(NULL) - 1;
+    pthread_rwlock_unlock(&store_lock);
+    
+    char **index_files = NULL;
+    size_t index_count = 0, index_capacity_used = 0;
+    if (collect_index_files("", &index_files, &index_count, &index_capacity_used) != 0) {
+        fprintf(stderr, "[ERROR] Out of memory listing version indexes, not pruning\n");
+        for (size_t i = 0; i < index_count; i++) free(index_files[i]);
+        free(index_files);
+        return;
+    }
+    
+    // Load every index; lines own the strings the records point into
+    VersionRecord *records = NULL;
+    size_t record_count = 0, record_capacity = 0;
+    size_t *file_start = calloc(index_count + 1, sizeof(size_t));
+    char **lines = NULL;
+    size_t line_count = 0, line_capacity = 0;
+    int out_of_memory = !file_start;
+    for (size_t i = 0; i < index_count && !out_of_memory; i++) {
+        file_start[i] = record_count;
+        char path[MAX_PATH], line[MAX_PATH + 256];
+        FILE *f = format_path(path, "%s/%s/%s", root->backup_directory, INDEX_DIR, index_files[i]) == 0
+                      ? fopen(path, "r") : NULL;
+        while (f && fgets(line, sizeof(line), f)) {
+            line[strcspn(line, "\n")] = '\0';
+            if (line_count == line_capacity) {
+                size_t capacity = line_capacity ? line_capacity * 2 : 1024;
+                char **grown = realloc(lines, capacity * sizeof(char *));
+                if (!grown) {
+                    out_of_memory = 1;
+                    break;
+                }
+                lines = grown;
+                line_capacity = capacity;
+            }
+            if (record_count == record_capacity) {
+                size_t capacity = record_capacity ? record_capacity * 2 : 1024;
+                VersionRecord *grown = realloc(records, capacity * sizeof(VersionRecord));
+                if (!grown) {
+                    out_of_memory = 1;
+                    break;
+                }
+                records = grown;
+                record_capacity = capacity;
+            }
+            char *copy = strdup(line);
+            if (!copy) {
+                out_of_memory = 1;
+                break;
+            }
+            lines[line_count++] = copy;
+            if (parse_version_line(copy, &records[record_count]) == 0) {
+                records[record_count].file = i;
+                record_count++;
+            }
+        }
+        if (f) fclose(f);
+        
+        size_t n = record_count - file_start[i];
+        qsort(records + file_start[i], n, sizeof(VersionRecord), compare_versions_desc);
+        apply_retention(records + file_start[i], n);
+    }
+    if (out_of_memory) {
+        // Pruning from a partial view could drop a file's newest version
+        fprintf(stderr, "[ERROR] Out of memory loading version indexes, not pruning\n");
+        free(file_start);
+        file_start = NULL;
+    }
+    if (file_start) file_start[index_count] = record_count;
+    
+    // Enforce the size cap by dropping the oldest kept versions that are
+    // not a file's newest. The cap counts what the versions take on disk,
+    // kept in size for the rest of this pass. A stored object shared by
+    // several versions counts once, and only frees its size with the last
+    // of them: refs[i] is the number of kept versions sharing records[i]'s
+    // object, kept on the first of them (owner[i]). Versions sharing the
+    // object of a file's newest version would free nothing, so they stay.
+    if (max_backup_bytes > 0 && file_start) {
+        long long total = 0;
+        size_t candidates = 0, shared = 0;
+        VersionRecord **order = malloc((record_count + 1) * sizeof(VersionRecord *));
+        VersionRecord **by_location = malloc((record_count + 1) * sizeof(VersionRecord *));
+        size_t *owner = malloc((record_count + 1) * sizeof(size_t));
+        size_t *refs = calloc(record_count + 1, sizeof(size_t));
+        char *pinned = calloc(record_count + 1, 1);
+        if (!order || !by_location || !owner || !refs || !pinned) {
+            // The retention rules above still apply
+            fprintf(stderr, "[ERROR] Out of memory applying --max-bytes, not pruning by size\n");
+        } else {
+            for (size_t i = 0; i < record_count; i++) {
+                owner[i] = i;
+                if (!records[i].keep) continue;
+                records[i].size = stored_size(&records[i]);
+                if (in_shared_store(&records[i])) {
+                    by_location[shared++] = &records[i];
+                } else {
+                    total += records[i].size;
+                    refs[i] = 1;
+                }
+                if (i != file_start[records[i].file]) {
+                    order[candidates++] = &records[i];
+                }
+            }
+            qsort(by_location, shared, sizeof(VersionRecord *), compare_record_ptrs_by_location);
+            for (size_t i = 0; i < shared; i++) {
+                size_t first = i;
+                while (i + 1 < shared &&
+                       strcmp(by_location[i + 1]->location, by_location[first]->location) == 0) {
+                    i++;
+                }
+                size_t head = (size_t)(by_location[first] - records);
+                total += records[head].size;
+                for (size_t j = first; j <= i; j++) {
+                    size_t r = (size_t)(by_location[j] - records);
+                    owner[r] = head;
+                    if (r == file_start[records[r].file]) pinned[head] = 1;
+                }
+                refs[head] = i - first + 1;
+            }
+            
+            qsort(order, candidates, sizeof(VersionRecord *), compare_record_ptrs_by_time);
+            for (size_t i = 0; i < candidates && total > max_backup_bytes; i++) {
+                size_t head = owner[order[i] - records];
+                if (pinned[head]) continue;
+                order[i]->keep = 0;
+                if (--refs[head] == 0) total -= records[head].size;
+            }
+        }
+        free(order);
+        free(by_location);
+        free(owner);
+        free(refs);
+        free(pinned);
+    }
+    
+    // Drop the versions from their indexes, then remove plain backup files
+    size_t pruned = 0;
+    long long freed = 0;
+    int shared_store = 0;
+    int *drop = malloc((record_count + 1) * sizeof(int));
+    for (size_t i = 0; i < index_count && file_start && drop; i++) {
+        size_t drop_count = 0;
+        for (size_t r = file_start[i]; r < file_start[i + 1]; r++) {
+            if (!records[r].keep) drop[drop_count++] = records[r].version;
+        }
+        if (drop_count == 0) continue;
+        qsort(drop, drop_count, sizeof(int), compare_ints);
+        if (rewrite_index(index_files[i], drop, drop_count) != 0) {
+            fprintf(stderr, "[ERROR] Cannot prune version index %s\n", index_files[i]);
+            continue;
+        }
+        
+        for (size_t r = file_start[i]; r < file_start[i + 1]; r++) {
+            if (records[r].keep) continue;
+            pruned++;
+            const char *location = records[r].location;
+            if (strncmp(location, OBJECTS_DIR "/", strlen(OBJECTS_DIR) + 1) == 0 ||
+                strncmp(location, MANIFESTS_DIR "/", strlen(MANIFESTS_DIR) + 1) == 0) {
+                shared_store = 1;
+                continue;
+            }
+            char path[MAX_PATH];
+            struct stat st;
+            if (format_path(path, "%s/%s", root->backup_directory, location) == 0 &&
+                stat(path, &st) == 0 && unlink(path) == 0) {
+                freed += (long long)st.st_size;
+            }
+        }
+    }
+    if (shared_store) {
+        freed += collect_garbage(gc_start, index_files, index_count);
+    }
+    if (pruned > 0) {
+        printf("[AutoBackup] Pruned %zu old version(s), freed %lld bytes\n", pruned, freed);
+    }
+    
+    free(drop);
+    for (size_t i = 0; i < line_count; i++) free(lines[i]);
+    free(lines);
+    free(records);
+    free(file_start);
+    for (size_t i = 0; i < index_count; i++) free(index_files[i]);
+    free(index_files);
+}
+
+// Background pruning thread: runs at the lowest CPU priority so it only
+// uses time the watcher does not need
+void *prune_worker(void *arg) {
+    (void)arg;
+#ifdef __linux__
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+#endif
+    while (1) {
+        for (int i = 0; i < root_count; i++) {
+            root = &roots[i];
+            prune_backups();
+        }
+        sleep(PRUNE_INTERVAL);
+    }
+    return NULL;
+}
+
+// Recover the tracked file name from an old-layout backup file name
+// ("<base>_v<N>_backup_<YYYYMMDD_HHMMSS><ext>" -> "<base><ext>"), and,
+// unless they are NULL, the version and local backup time it names.
+// Returns -1 if the name does not have that shape.
+int parse_backup_name(const char *filename, char *original, int *version, time_t *when) {
+    const char *marker = NULL;
+    for (const char *p = strstr(filename, "_backup_"); p; p = strstr(p + 1, "_backup_")) {
+        marker = p;
+    }
+    if (!marker) {
+        return -1;
+    }
+    
+    // Version digits right before the marker, preceded by "_v"
+    const char *v = marker;
+    while (v > filename && isdigit((unsigned char)v[-1])) v--;
+    if (v == marker || v - filename < 2 || v[-1] != 'v' || v[-2] != '_') {
+        return -1;
+    }
+    
+    // Timestamp: 8 digits, '_', 6 digits
+    const char *ts = marker + strlen("_backup_");
+    for (int i = 0; i < 15; i++) {
+        if (i == 8 ? ts[i] != '_' : !isdigit((unsigned char)ts[i])) {
+            return -1;
+        }
+    }
+    if (format_path(original, "%.*s%s", (int)(v - 2 - filename), filename, ts + 15) != 0) {
+        return -1;
+    }
+    if (version) {
+        *version = atoi(v);
+    }
+    if (when) {
+        struct tm tm = { 0 };
+        sscanf(ts, "%4d%2d%2d_%2d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        tm.tm_isdst = -1;
+        *when = mktime(&tm);
+    }
+    return 0;
+}
+
+// Move an old-layout backup (location relative to backup_directory) of
+// the tracked file name into the sharded layout. new_location receives
+// its new location. Returns 0 if it was moved.
+int migrate_backup(const char *location, const char *name, char *new_location) {
+    const char *filename = strrchr(location, '/');
+    filename = filename ? filename + 1 : location;
+    char from[MAX_PATH], to[MAX_PATH], to_dir[MAX_PATH];
+    if (format_path(new_location, "%s/%s/%s", VERSIONS_DIR, name, filename) != 0 ||
+        format_path(from, "%s/%s", root->backup_directory, location) != 0 ||
+        format_path(to, "%s/%s", root->backup_directory, new_location) != 0 ||
+        format_path(to_dir, "%s/%s/%s", root->backup_directory, VERSIONS_DIR, name) != 0) {
+        fprintf(stderr, "[ERROR] Cannot move %s: %s\n", location, strerror(errno));
+        return -1;
+    }
+    if (access(from, F_OK) != 0) {
+        return -1;  // Already gone (pruned or deleted by hand)
+    }
+    if (make_dirs(to_dir) != 0 || rename(from, to) != 0) {
+        fprintf(stderr, "[ERROR] Cannot move %s to %s: %s\n", from, to, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Is this top-level entry of the backup directory one of ours rather than
+// a mirrored subdirectory of the old layout?
+static int is_reserved_entry(const char *name) {
+    return name[0] == '.' || strcmp(name, INDEX_DIR) == 0 ||
+           strcmp(name, OBJECTS_DIR) == 0 || strcmp(name, MANIFESTS_DIR) == 0 ||
+           strcmp(name, VERSIONS_DIR) == 0;
+}
+
+// Move every old-layout backup file left below dir (relative to
+// backup_directory) into the sharded layout, removing directories that
+// end up empty. These predate the version index, so each one moved gets
+// an index line from its name, size and content. Returns the number of
+// files moved.
+size_t migrate_directory(const char *dir) {
+    char path[MAX_PATH];
+    DIR *d = format_path(path, "%s%s%s", root->backup_directory, dir[0] ? "/" : "", dir) == 0
+                 ? opendir(path) : NULL;
+    if (!d) {
+        return 0;
+    }
+    
+    size_t moved = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (dir[0] == '\0' && is_reserved_entry(entry->d_name)) {
+            continue;
+        }
+        char location[MAX_PATH], original[MAX_PATH], name[MAX_PATH], moved_to[MAX_PATH];
+        int version;
+        time_t when;
+        if (format_path(location, "%s%s%s", dir, dir[0] ? "/" : "", entry->d_name) != 0) {
+            continue;
+        }
+        
+        struct stat st;
+        if (fstatat(dirfd(d), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            moved += migrate_directory(location);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode) ||
+            parse_backup_name(entry->d_name, original, &version, &when) != 0) {
+            continue;
+        }
+        if (format_path(name, "%s%s%s", dir, dir[0] ? "/" : "", original) != 0 ||
+            migrate_backup(location, name, moved_to) != 0) {
+            continue;
+        }
+        moved++;
+        
+        char moved_path[MAX_PATH];
+        unsigned char hash[HASH_LEN];
+        if (version < 1 || format_path(moved_path, "%s/%s", root->backup_directory, moved_to) != 0 ||
+            calculate_hash(moved_path, hash_algo, hash) != 0 ||
+            append_version(name, version, when, hash, st.st_size, moved_to) != 0) {
+            fprintf(stderr, "[WARN] Moved %s but could not index it\n", moved_to);
+        }
+    }
+    closedir(d);
+    
+    if (dir[0]) {
+        rmdir(path);  // Only succeeds once the directory is empty
+    }
+    return moved;
+}
+
+// Convert an existing backup directory from the old layout (versions of
+// all files side by side, mirroring the watched tree) to the sharded one.
+// Files named in a version index are moved and their index lines updated;
+// older backups that predate the index are recognised by their names.
+// Must not run while another instance is watching the directory.
+// Returns 0 on success.
+int migrate_layout() {
+    char **index_files = NULL;
+    size_t index_count = 0, index_capacity_used = 0, moved = 0;
+    int failed = 0;
+    if (collect_index_files("", &index_files, &index_count, &index_capacity_used) != 0) {
+        // Backups of indexes left out would be taken for unindexed ones
+        fprintf(stderr, "[ERROR] Out of memory listing version indexes, not migrating\n");
+        for (size_t i = 0; i < index_count; i++) free(index_files[i]);
+        free(index_files);
+        return -1;
+    }
+    
+    for (size_t i = 0; i < index_count; i++) {
+        char path[MAX_PATH], temp[MAX_PATH], name[MAX_PATH];
+        int fits = format_path(path, "%s/%s/%s", root->backup_directory, INDEX_DIR,
+                               index_files[i]) == 0 &&
+                   format_path(temp, "%s.migrate", path) == 0 &&
+                   format_path(name, "%.*s", (int)(strlen(index_files[i]) - strlen(INDEX_SUFFIX)),
+                               index_files[i]) == 0;
+        
+        FILE *in = fits ? fopen(path, "r") : NULL;
+        FILE *out = in ? fopen(temp, "w") : NULL;
+        if (!out) {
+            if (in) fclose(in);
+            failed = -1;
+            continue;
+        }
+        char line[MAX_PATH + 256], copy[MAX_PATH + 256];
+        int write_failed = 0;
+        while (fgets(line, sizeof(line), in)) {
+            VersionRecord record;
+            char new_location[MAX_PATH];
+            memcpy(copy, line, sizeof(line));
+            copy[strcspn(copy, "\n")] = '\0';
+            
+            if (parse_version_line(copy, &record) == 0 &&
+                strncmp(record.location, VERSIONS_DIR "/", strlen(VERSIONS_DIR) + 1) != 0 &&
+                strncmp(record.location, OBJECTS_DIR "/", strlen(OBJECTS_DIR) + 1) != 0 &&
+                strncmp(record.location, MANIFESTS_DIR "/", strlen(MANIFESTS_DIR) + 1) != 0 &&
+                migrate_backup(record.location, name, new_location) == 0) {
+                // Keep the first five fields as they were
+                size_t prefix = (size_t)(record.location - copy);
+                if (fprintf(out, "%.*s%s\n", (int)prefix, line, new_location) < 0) write_failed = 1;
+                moved++;
+                continue;
+            }
+            if (fputs(line, out) == EOF) write_failed = 1;
+        }
+        fclose(in);
+        if (fclose(out) != 0) write_failed = 1;
+        if (write_failed || rename(temp, path) != 0) {
+            fprintf(stderr, "[ERROR] Cannot rewrite version index %s\n", path);
+            unlink(temp);
+            failed = -1;
+        }
+    }
+    for (size_t i = 0; i < index_count; i++) free(index_files[i]);
+    free(index_files);
+    
+    moved += migrate_directory("");
+    printf("[AutoBackup] Migrated %zu backup file(s) to %s/%s\n", moved, root->backup_directory, VERSIONS_DIR);
+    return failed;
+}
+
+// Parse a --at point in time: "vN" (version N), "@EPOCH", a local
+// "YYYY-MM-DD[ HH:MM[:SS]]" (or with a 'T'), or "N[smhdw]" meaning that
+// long ago. Sets *version for "vN" and *at otherwise. Returns -1 if the
+// spec is not understood.
+int parse_point(const char *spec, time_t *at, int *version) {
+    char *end;
+    if (spec[0] == 'v' && isdigit((unsigned char)spec[1])) {
+        long v = strtol(spec + 1, &end, 10);
+        if (*end || v < 1 || v > INT_MAX) return -1;
+        *version = (int)v;
+        return 0;
+    }
+    if (spec[0] == '@') {
+        long long epoch = strtoll(spec + 1, &end, 10);
+        if (end == spec + 1 || *end) return -1;
+        *at = (time_t)epoch;
+        return 0;
+    }
+    
+    static const char *formats[] = {
+        "%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%dT%H:%M", "%Y-%m-%d"
+    };
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        struct tm tm = {0};
+        const char *rest = strptime(spec, formats[i], &tm);
+        if (rest && *rest == '\0') {
+            tm.tm_isdst = -1;
+            *at = mktime(&tm);
+            return *at == (time_t)-1 ? -1 : 0;
+        }
+    }
+    
+    long long amount = strtoll(spec, &end, 10);
+    if (end == spec || amount < 0 || (end[0] && end[1])) return -1;
+    long long unit;
+    switch (*end) {
+    case '\0': case 's': unit = 1; break;
+    case 'm': unit = 60; break;
+    case 'h': unit = 3600; break;
+    case 'd': unit = 86400; break;
+    case 'w': unit = 7 * 86400; break;
+    default: return -1;
+    }
+    *at = time(NULL) - (time_t)(amount * unit);
+    return 0;
+}
+
+// Sort version records oldest first. A version number recorded twice
+// (reused after a crash between syncing the index and the journal)
+// keeps index order, so the later line wins.
+static int compare_versions_asc(const void *a, const void *b) {
+    const VersionRecord *x = a, *y = b;
+    if (x->version != y->version) return (x->version > y->version) - (x->version < y->version);
+    return (x->location > y->location) - (x->location < y->location);
+}
+
+// Read the version index of the tracked file name into *records, oldest
+// first. The records point into *text; the caller frees both. Returns the
+// number of versions, or -1 if the index cannot be read.
+ssize_t load_versions(const char *name, char **text, VersionRecord **records) {
+    char path[MAX_PATH];
+    *text = NULL;
+    *records = NULL;
+    
+    int fd = index_path_for(name, path) == 0 ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    char *buffer = malloc((size_t)st.st_size + 1);
+    ssize_t length = 0, bytes = 0;
+    while (buffer && length < st.st_size &&
+           (bytes = read(fd, buffer + length, (size_t)(st.st_size - length))) != 0) {
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        length += bytes;
+    }
+    close(fd);
+    if (!buffer || bytes < 0) {
+        free(buffer);
+        return -1;
+    }
+    buffer[length] = '\0';
+    
+    // At most one record per line
+    size_t lines = 1;
+    for (ssize_t i = 0; i < length; i++) lines += buffer[i] == '\n';
+    VersionRecord *list = malloc(lines * sizeof(VersionRecord));
+    if (!list) {
+        free(buffer);
+        return -1;
+    }
+    size_t count = 0;
+    for (char *line = buffer, *next; line; line = next) {
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        if (parse_version_line(line, &list[count]) == 0) count++;
+    }
+    qsort(list, count, sizeof(VersionRecord), compare_versions_asc);
+    *text = buffer;
+    *records = list;
+    return (ssize_t)count;
+}
+
+// Pick the record for version, or if version is 0 the newest backed up at
+// or before at. Returns its index, or -1 if there is none.
+ssize_t pick_version(const VersionRecord *records, size_t count, time_t at, int version) {
+    ssize_t picked = -1;
+    for (size_t i = 0; i < count; i++) {
+        if (version ? records[i].version == version : records[i].time <= at) {
+            picked = (ssize_t)i;
+        }
+    }
+    return picked;
+}
+
+// Which codec the plain backup of the tracked file name at location (open
+// as fd) was written with. The frame magic at its start names the codec;
+// the backup file name decides whether it was compressed at all (a codec
+// suffix beyond the tracked name), so a raw backup of a tracked .zst file
+// is not taken for a frame. Returns -1 with errno EIO if a compressed
+// backup does not start with a known frame.
+int backup_codec(const char *name, const char *location, int fd) {
+    const char *filename = strrchr(location, '/');
+    const char *base = strrchr(name, '/');
+    char original[MAX_PATH];
+    if (parse_backup_name(filename ? filename + 1 : location, original, NULL, NULL) != 0 ||
+        strcmp(original, base ? base + 1 : name) == 0) {
+        return CODEC_NONE;
+    }
+    unsigned char magic[4];
+    if (pread(fd, magic, sizeof(magic), 0) == (ssize_t)sizeof(magic)) {
+        for (int i = 1; i < CODEC_COUNT; i++) {
+            if (memcmp(magic, codec_magics[i], sizeof(magic)) == 0) return i;
+        }
+    }
+    errno = EIO;
+    return -1;
+}
+
+// Write the content of one backed up version of name into the empty
+// dst_fd: a dedup object or plain backup is reflinked or copied in the
+// kernel when possible, a chunked manifest is reassembled chunk by chunk
+// and a compressed backup is decompressed. Returns 0, or -1 with errno set.
+int restore_content(const char *name, const VersionRecord *record, int dst_fd) {
+    char path[MAX_PATH];
+    if (format_path(path, "%s/%s", root->backup_directory, record->location) != 0) {
+        return -1;
+    }
+    int failed = 0;
+    
+    if (strncmp(record->location, MANIFESTS_DIR "/", strlen(MANIFESTS_DIR) + 1) == 0) {
+        FILE *m = fopen(path, "r");
+        char line[256], hex[HASH_SIZE], chunk[MAX_PATH];
+        failed = m ? 0 : -1;
+        while (!failed && fgets(line, sizeof(line), m)) {
+            if (sscanf(line, "%64s", hex) != 1 || strlen(hex) <= 2) continue;
+            int fd = format_path(chunk, "%s/%s/%.2s/%s", root->backup_directory, OBJECTS_DIR,
+                                 hex, hex + 2) == 0 ? open(chunk, O_RDONLY | O_CLOEXEC) : -1;
+            if (fd < 0 || append_file_data(fd, dst_fd) != 0) failed = -1;
+            if (fd >= 0) close(fd);
+        }
+        if (m) fclose(m);
+    } else {
+        int src = open(path, O_RDONLY | O_CLOEXEC);
+        int codec = src < 0 || strncmp(record->location, OBJECTS_DIR "/", strlen(OBJECTS_DIR) + 1) == 0
+                    ? CODEC_NONE : backup_codec(name, record->location, src);
+        if (src < 0 || codec < 0) {
+            failed = -1;
+        } else {
+            failed = codec != CODEC_NONE ? decompress_file_data(src, dst_fd, (Codec)codec)
+                                         : copy_file_data(src, dst_fd);
+        }
+        if (src >= 0) close(src);
+    }
+    
+    // A missing chunk or short backup must not pass for the version
+    struct stat st;
+    if (!failed && (fstat(dst_fd, &st) != 0 || (long long)st.st_size != record->size)) {
+        errno = EIO;
+        failed = -1;
+    }
+    return failed;
+}
+
+// Restore one version of the tracked file name to target_dir/name. The
+// content goes to a temporary file next to it, which then replaces the
+// file in one rename, so the file is never seen half restored. Returns 0
+// on success.
+int restore_file(const char *name, const VersionRecord *record, const char *target_dir) {
+    char target[MAX_PATH], dir[MAX_PATH], temp[MAX_PATH];
+    if (format_path(target, "%s/%s", target_dir, name) != 0) {
+        fprintf(stderr, "[ERROR] Cannot restore %s to %s: %s\n", name, target_dir, strerror(errno));
+        return -1;
+    }
+    strcpy(dir, target);
+    *strrchr(dir, '/') = '\0';
+    if (make_dirs(dir) != 0) {
+        fprintf(stderr, "[ERROR] Cannot create %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    
+    int fd = format_path(temp, "%s/.autobackup-restore-XXXXXX", dir) == 0 ? mkstemp(temp) : -1;
+    if (fd < 0) {
+        fprintf(stderr, "[ERROR] Cannot create a temporary file in %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    fchmod(fd, stat(target, &st) == 0 ? (st.st_mode & 07777) : 0644);
+    
+    int failed = restore_content(name, record, fd);
+    int saved = errno;
+    if (close(fd) != 0 && !failed) {
+        saved = errno;
+        failed = -1;
+    }
+    if (!failed && rename(temp, target) != 0) {
+        saved = errno;
+        failed = -1;
+    }
+    if (failed) {
+        unlink(temp);
+        fprintf(stderr, "[ERROR] Cannot restore %s v%d from %s: %s\n",
+                name, record->version, record->location, strerror(saved));
+        return -1;
+    }
+    printf("✓ Restored: %s ← v%d (%s)\n", name, record->version, target);
+    return 0;
+}
+
+// Sort index file names
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Format a backup time for --log output
+static void format_time(time_t t, char *buffer, size_t size) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    strftime(buffer, size, "%Y-%m-%d %H:%M:%S", &tm);
+}
+
+// --log and --restore: list or restore the tracked files named in files
+// (relative to watch_directory; a directory stands for every file below
+// it, no names for the whole tree). With version set only that version
+// is used, otherwise the newest backed up at or before at; --log without
+// --at lists every version. restored files go below target_dir.
+int run_query(char **files, int file_count, int restore, int list_all,
+              time_t at, int version, const char *target_dir) {
+    char **names = NULL;
+    size_t name_count = 0, name_capacity = 0;
+    size_t prefix = strlen(root->watch_directory);
+    
+    int out_of_memory = file_count == 0 &&
+                        collect_index_files("", &names, &name_count, &name_capacity) != 0;
+    for (int i = 0; i < file_count && !out_of_memory; i++) {
+        char name[MAX_PATH], path[MAX_PATH];
+        const char *file = files[i];
+        if (strncmp(file, root->watch_directory, prefix) == 0 && file[prefix] == '/') {
+            file += prefix + 1;
+        }
+        while (file[0] == '.' && file[1] == '/') file += 2;
+        if (format_path(name, "%s", file) != 0) {
+            fprintf(stderr, "[WARN] No backups of %s: %s\n", file, strerror(errno));
+            continue;
+        }
+        for (size_t len = strlen(name); len > 0 && name[len - 1] == '/'; len--) {
+            name[len - 1] = '\0';
+        }
+        
+        if (index_path_for(name, path) != 0) {
+            fprintf(stderr, "[WARN] No backups of %s: %s\n", name, strerror(errno));
+            continue;
+        }
+        size_t before = name_count;
+        if (access(path, F_OK) == 0) {
+            if (name_count == name_capacity) {
+                size_t capacity = name_capacity ? name_capacity * 2 : 16;
+                char **grown = realloc(names, capacity * sizeof(char *));
+                if (!grown) {
+                    out_of_memory = 1;
+                    break;
+                }
+                names = grown;
+                name_capacity = capacity;
+            }
+            format_path(path, "%s%s", name, INDEX_SUFFIX);  // Shorter than the index path
+            if (!(names[name_count] = strdup(path))) {
+                out_of_memory = 1;
+                break;
+            }
+            name_count++;
+        } else if (collect_index_files(name, &names, &name_count, &name_capacity) != 0) {
+            out_of_memory = 1;
+            break;
+        }
+        if (name_count == before) {
+            fprintf(stderr, "[WARN] No backups of %s\n", name);
+        }
+    }
+    if (out_of_memory) {
+        fprintf(stderr, "[ERROR] Out of memory listing version indexes\n");
+        for (size_t i = 0; i < name_count; i++) free(names[i]);
+        free(names);
+        return -1;
+    }
+    qsort(names, name_count, sizeof(char *), compare_strings);
+    
+    int failed = 0;
+    size_t matched = 0, restored = 0;
+    for (size_t i = 0; i < name_count; i++) {
+        char name[MAX_PATH], when[32];
+        format_path(name, "%.*s", (int)(strlen(names[i]) - strlen(INDEX_SUFFIX)), names[i]);
+        
+        char *text;
+        VersionRecord *records;
+        ssize_t count = load_versions(name, &text, &records);
+        if (count < 0) {
+            fprintf(stderr, "[ERROR] Cannot read version index of %s: %s\n", name, strerror(errno));
+            failed = 1;
+            continue;
+        }
+        ssize_t picked = pick_version(records, (size_t)count, at, version);
+        
+        if (!restore && list_all) {
+            printf("%s: %zd version(s)\n", name, count);
+            for (ssize_t r = 0; r < count; r++) {
+                format_time(records[r].time, when, sizeof(when));
+                printf("  v%-5d %s %12lld bytes  %.12s  %s\n", records[r].version, when,
+                       records[r].size, records[r].hash, records[r].location);
+            }
+            matched += count > 0;
+        } else if (picked >= 0) {
+            const VersionRecord *record = &records[picked];
+            matched++;
+            if (restore) {
+                if (restore_file(name, record, target_dir) == 0) {
+                    restored++;
+                } else {
+                    failed = 1;
+                }
+            } else {
+                format_time(record->time, when, sizeof(when));
+                printf("v%-5d %s %12lld bytes  %s (%zd version(s))\n", record->version, when,
+                       record->size, name, count);
+            }
+        }
+        free(records);
+        free(text);
+    }
+    
+    if (restore) {
+        printf("[AutoBackup] Restored %zu of %zu file(s) to %s\n", restored, name_count, target_dir);
+    } else if (matched < name_count && !list_all) {
+        printf("[AutoBackup] %zu of %zu file(s) had no matching version\n",
+               name_count - matched, name_count);
+    }
+    for (size_t i = 0; i < name_count; i++) free(names[i]);
+    free(names);
+    return failed || (name_count == 0 && file_count > 0) ? -1 : 0;
+}
+
+// Format one state line into line:
+// name|hash|mtime|version|algo|size|inode|mtime_ns|ctime_ns
+// (mtime in seconds comes first to stay readable by the original format).
+// Returns its length, or -1 if it does not fit.
+int format_entry(char *line, size_t size, const FileState *fs) {
+    char hex[HASH_SIZE];
+    hash_to_hex(fs->hash, hex);
+    int len = snprintf(line, size, "%s|%s|%lld|%d|%s|%llu|%llu|%lld|%lld\n",
+            fs->filename,
+            hex,
+            (long long)(fs->mtime_ns / 1000000000),
+            fs->version,
+            hash_algo_names[fs->hash_algo],
+            (unsigned long long)fs->size,
+            (unsigned long long)fs->inode,
+            (long long)fs->mtime_ns,
+            (long long)fs->ctime_ns);
+    return len < 0 || (size_t)len >= size ? -1 : len;
+}
+
+// Split the last '|'-separated field off line, returns NULL if none is left
+static char *pop_field(char *line) {
+    char *sep = strrchr(line, '|');
+    if (!sep) return NULL;
+    *sep = '\0';
+    return sep + 1;
+}
+
+// Is this one of the known algorithm names (compiled in or not)?
+static int is_algo_name(const char *name) {
+    for (int i = 0; i < HASH_ALGO_COUNT; i++) {
+        if (strcmp(name, hash_algo_names[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+// Parse a state line and add or update its entry. Fields are split from
+// the right so filenames may contain '|'. Three layouts are accepted:
+//   name|hash|mtime|version                       (original)
+//   name|hash|mtime|version|algo                  (with hash algorithm)
+//   name|hash|mtime|version|algo|size|inode|mtime_ns|ctime_ns
+// Entries without a full stat signature are re-hashed on the first check.
+// Returns -1 if the line is malformed (e.g. torn by a crash).
+int apply_entry(char *line) {
+    size_t len = strlen(line);
+    if (len == 0 || line[len - 1] != '\n') {
+        return -1;
+    }
+    line[len - 1] = '\0';
+    
+    const char *algo = "sha256";
+    const char *version = NULL;
+    int64_t mtime_ns = 0, ctime_ns = 0;
+    uint64_t size = 0, inode = 0;
+    
+    char *last = pop_field(line);
+    if (!last) return -1;
+    if (!isdigit((unsigned char)last[0])) {
+        algo = last;
+    } else {
+        // Either the full layout, or the original one ending in version
+        char *tail[4] = { last, NULL, NULL, NULL };
+        int popped = 1;
+        while (popped < 4 && (tail[popped] = pop_field(line)) != NULL) popped++;
+        char *maybe_algo = popped == 4 ? pop_field(line) : NULL;
+        
+        if (maybe_algo && is_algo_name(maybe_algo)) {
+            ctime_ns = atoll(tail[0]);
+            mtime_ns = atoll(tail[1]);
+            inode = strtoull(tail[2], NULL, 10);
+            size = strtoull(tail[3], NULL, 10);
+            algo = maybe_algo;
+        } else {
+            // Put back the separators that belonged to the name or hash
+            if (maybe_algo) maybe_algo[-1] = '|';
+            for (int i = popped - 1; i >= 1; i--) tail[i][-1] = '|';
+            version = last;
+        }
+    }
+    
+    if (!version && !(version = pop_field(line))) return -1;
+    char *mtime = pop_field(line);
+    char *hex = mtime ? pop_field(line) : NULL;
+    if (!hex || line[0] == '\0') return -1;
+    if (mtime_ns == 0) {
+        mtime_ns = (int64_t)atoll(mtime) * 1000000000;
+    }
+    
+    int index = find_file(line);
+    FileState *fs = index >= 0 ? &root->tracked_files[index] : append_file(line);
+    int parsed = parse_hash_algo(algo);
+    if (parsed < 0 || strlen(hex) != HASH_LEN * 2 || hex_to_hash(hex, fs->hash) != 0) {
+        // Unknown algorithm: an all-zero hash forces a fresh comparison
+        parsed = hash_algo;
+        memset(fs->hash, 0, HASH_LEN);
+    }
+    fs->hash_algo = (unsigned char)parsed;
+    fs->version = atoi(version);
+    fs->mtime_ns = mtime_ns;
+    fs->ctime_ns = ctime_ns;
+    fs->size = size;
+    fs->inode = inode;
+    return 0;
+}
+
+// Save a full snapshot of the tracking state in the binary format.
+// Written to a temporary file, synced and renamed over the old snapshot,
+// so a crash leaves either the old or the new snapshot, never a truncated one.
+// The backups it records are synced first. Returns 0 on success.
+int save_state() {
+    char state_file[MAX_PATH], temp_file[MAX_PATH];
+    if (format_path(state_file, "%s/%s", root->watch_directory, STATE_FILE) != 0 ||
+        format_path(temp_file, "%s.tmp", state_file) != 0) {
+        fprintf(stderr, "[ERROR] Cannot write the state of %s: %s\n",
+                root->watch_directory, strerror(errno));
+        return -1;
+    }
+    
+    if (sync_backups() != 0) {
+        return -1;
+    }
+    FILE *f = fopen(temp_file, "wb");
+    if (!f) {
+        fprintf(stderr, "[ERROR] Cannot write %s: %s\n", temp_file, strerror(errno));
+        return -1;
+    }
+    
+    StateHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STATE_MAGIC, sizeof(header.magic));
+    header.format_version = STATE_FORMAT_VERSION;
+    header.record_size = sizeof(StateRecord);
+    header.record_count = (uint64_t)root->file_count;
+    header.strings_offset = sizeof(StateHeader) + (uint64_t)root->file_count * sizeof(StateRecord);
+    fwrite(&header, sizeof(header), 1, f);
+    
+    uint64_t offset = 0;
+    for (int i = 0; i < root->file_count; i++) {
+        const FileState *fs = &root->tracked_files[i];
+        StateRecord record;
+        memset(&record, 0, sizeof(record));
+        record.name_offset = offset;
+        record.mtime_ns = fs->mtime_ns;
+        record.ctime_ns = fs->ctime_ns;
+        record.size = fs->size;
+        record.inode = fs->inode;
+        record.version = fs->version;
+        record.hash_algo = fs->hash_algo;
+        memcpy(record.hash, fs->hash, HASH_LEN);
+        fwrite(&record, sizeof(record), 1, f);
+        offset += strlen(fs->filename) + 1;
+    }
+    for (int i = 0; i < root->file_count; i++) {
+        fwrite(root->tracked_files[i].filename, 1, strlen(root->tracked_files[i].filename) + 1, f);
+    }
+    
+    // Patch in the string table size now that it is known
+    header.strings_size = offset;
+    int failed = ferror(f) || fseek(f, 0, SEEK_SET) != 0 ||
+                 fwrite(&header, sizeof(header), 1, f) != 1 ||
+                 fflush(f) != 0 || fsync(fileno(f)) != 0;
+    if (fclose(f) != 0) failed = 1;
+    if (failed || rename(temp_file, state_file) != 0) {
+        fprintf(stderr, "[ERROR] Cannot write %s: %s\n", state_file, strerror(errno));
+        unlink(temp_file);
+        return -1;
+    }
+    
+    // Make the rename itself durable
+    int dir_fd = open(root->watch_directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    return 0;
+}
+
+// Map a binary snapshot and load its records. Filenames point straight
+// into the mapping, which is kept for the life of the process (a later
+// snapshot replaces the file by rename, leaving this mapping intact).
+// Returns 0 on success, 1 if the file is not a binary snapshot, -1 if
+// it is one but is damaged.
+int load_binary_state(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 1;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(StateHeader)) {
+        close(fd);
+        return 1;
+    }
+    size_t size = (size_t)st.st_size;
+    const char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return 1;
+    }
+    
+    const StateHeader *header = (const StateHeader *)map;
+    if (memcmp(header->magic, STATE_MAGIC, sizeof(header->magic)) != 0) {
+        munmap((void *)map, size);
+        return 1;
+    }
+    
+    // Validate everything up front; the loop below trusts the layout.
+    // Version 1 snapshots lack the stat signature and are upgraded in memory.
+    size_t record_size = header->format_version == 1 ? sizeof(StateRecordV1)
+                                                     : sizeof(StateRecord);
+    // The records must fit after the header; checked by division so a huge
+    // count cannot overflow records_end
+    int records_fit = header->record_count <= (size - sizeof(StateHeader)) / record_size;
+    uint64_t records_end = records_fit ? sizeof(StateHeader) + header->record_count * record_size
+                                       : size + 1;
+    if (header->format_version < 1 || header->format_version > STATE_FORMAT_VERSION ||
+        header->record_size != record_size ||
+        !records_fit || records_end > size ||
+        header->strings_offset != records_end ||
+        header->strings_size > size - records_end ||
+        (header->strings_size > 0 && map[records_end + header->strings_size - 1] != '\0')) {
+        fprintf(stderr, "[WARN] Ignoring damaged or unsupported state file %s\n", path);
+        munmap((void *)map, size);
+        return -1;
+    }
+    
+    const char *records = map + sizeof(StateHeader);
+    const char *strings = map + header->strings_offset;
+    reserve_files(root->file_count + (int)header->record_count);
+    for (uint64_t i = 0; i < header->record_count; i++) {
+        StateRecord record;
+        if (header->format_version == 1) {
+            const StateRecordV1 *old = (const StateRecordV1 *)(records + i * record_size);
+            memset(&record, 0, sizeof(record));
+            record.name_offset = old->name_offset;
+            record.mtime_ns = old->last_modified * 1000000000;
+            record.version = old->version;
+            record.hash_algo = old->hash_algo;
+            memcpy(record.hash, old->hash, HASH_LEN);
+        } else {
+            memcpy(&record, records + i * record_size, sizeof(record));
+        }
+        if (record.name_offset >= header->strings_size ||
+            record.hash_algo >= HASH_ALGO_COUNT) {
+            continue;
+        }
+        const char *name = strings + record.name_offset;
+        if (find_file(name) >= 0) {
+            continue;
+        }
+        
+        FileState *fs = append_entry(name);
+        memcpy(fs->hash, record.hash, HASH_LEN);
+        fs->hash_algo = record.hash_algo;
+        fs->version = record.version;
+        fs->mtime_ns = record.mtime_ns;
+        fs->ctime_ns = record.ctime_ns;
+        fs->size = record.size;
+        fs->inode = record.inode;
+    }
+    return 0;
+}
+
+// Load a snapshot in the original text format (migrated to binary on the
+// first compaction)
+void load_text_state(FILE *f) {
+    char line[MAX_PATH + 128];
+    
+    // The leading count is informational; entries run to end of file
+    if (fgets(line, sizeof(line), f)) {
+        while (fgets(line, sizeof(line), f)) {
+            if (apply_entry(line) != 0) break;
+        }
+    }
+}
+
+// Load tracking state: the last snapshot, then the journal replayed on top
+void load_state() {
+    char path[MAX_PATH];
+    char line[MAX_PATH + 128];
+    
+    if (format_path(path, "%s/%s", root->watch_directory, STATE_FILE) == 0 &&
+        load_binary_state(path) == 1) {
+        FILE *f = fopen(path, "r");
+        if (f) {
+            load_text_state(f);
+            fclose(f);
+            root->journal_entries++;  // Rewrite it in the binary format at startup
+        }
+    }
+    
+    FILE *f = format_path(path, "%s/%s", root->watch_directory, JOURNAL_FILE) == 0
+                  ? fopen(path, "r") : NULL;
+    if (f) {
+        // A torn last record from a crash simply ends the replay
+        while (fgets(line, sizeof(line), f)) {
+            if (apply_entry(line) != 0) break;
+            root->journal_entries++;
+        }
+        fclose(f);
+    }
+    
+    if (root->file_count > 0) {
+        printf("[AutoBackup] Loaded state: tracking %d files\n", root->file_count);
+    }
+}
+
+// Open the journal for appending, folding any replayed records into a
+// fresh snapshot first
+void open_journal() {
+    char path[MAX_PATH];
+    root->journal = format_path(path, "%s/%s", root->watch_directory, JOURNAL_FILE) == 0
+                        ? fopen(path, "a") : NULL;
+    if (!root->journal) {
+        fprintf(stderr, "[WARN] Cannot open %s (%s), saving full snapshots instead\n",
+                path, strerror(errno));
+        return;
+    }
+    if (root->journal_entries > 0) {
+        compact_state();
+    }
+}
+
+// Record a new or updated entry. It is kept in memory, so it cannot reach
+// the disk before the backup it describes; durable after the next
+// journal_commit().
+void journal_entry(const FileState *fs) {
+    root->journal_dirty = 1;
+    if (!root->journal) {
+        return;
+    }
+    char line[MAX_PATH + 256];
+    int len = format_entry(line, sizeof(line), fs);
+    if (len < 0) {
+        return;  // Cannot happen with names under MAX_PATH
+    }
+    if (root->journal_capacity - root->journal_length < (size_t)len) {
+        size_t capacity = root->journal_capacity ? root->journal_capacity * 2 : 65536;
+        char *grown = realloc(root->journal_buffer, capacity);
+        if (!grown) {
+            // The table still has the change, a snapshot will save it
+            fprintf(stderr, "[WARN] Out of memory for the state journal, saving full snapshots instead\n");
+            fclose(root->journal);
+            root->journal = NULL;
+            root->journal_length = 0;
+            return;
+        }
+        root->journal_buffer = grown;
+        root->journal_capacity = capacity;
+    }
+    memcpy(root->journal_buffer + root->journal_length, line, (size_t)len);
+    root->journal_length += (size_t)len;
+    root->journal_entries++;
+}
+
+// Flush the file system holding the backup directory: one syncfs() on
+// Linux, sync() elsewhere. Returns 0, or -1 if it failed.
+static int sync_backup_directory() {
+#ifdef __linux__
+    int fd = open(root->backup_directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || syncfs(fd) != 0) {
+        fprintf(stderr, "[ERROR] Cannot sync backups in %s: %s\n",
+                root->backup_directory, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    close(fd);
+#else
+    sync();
+#endif
+    return 0;
+}
+
+// Make the backups written since the last call durable with their
+// renames, then append their held version index lines and sync those:
+// an index line never names a backup that is not on disk, and the
+// journal records that follow never name a version missing from its
+// index. Lines held once the first sync has started wait for the next
+// call. Returns 0, or -1 if they are not known to be on disk.
+int sync_backups() {
+    pthread_mutex_lock(&held_lock);
+    size_t held = root->held_count;
+    pthread_mutex_unlock(&held_lock);
+    if (root->unsynced_backups == 0 && held == 0) {
+        return 0;
+    }
+    if (sync_backup_directory() != 0) {
+        return -1;
+    }
+    root->unsynced_backups = 0;
+    root->synced_ns = monotonic_ns();
+    METRIC_ADD(syncs, 1);
+    if (held == 0) {
+        return 0;
+    }
+    
+    // Writers only append, so the first held entries stay where they are.
+    // They stay listed (for collect_garbage()) until written; ones that
+    // cannot be written are kept for the next call
+    char *written = calloc(held, 1);
+    if (!written) {
+        root->unsynced_backups = 1;
+        return -1;
+    }
+    pthread_rwlock_rdlock(&store_lock);
+    for (size_t i = 0; i < held; i++) {
+        pthread_mutex_lock(&held_lock);
+        HeldVersion version = root->held_versions[i];
+        pthread_mutex_unlock(&held_lock);
+        written[i] = append_version(version.name, version.version, version.time, version.hash,
+                                    (off_t)version.size, version.location) == 0;
+    }
+    pthread_rwlock_unlock(&store_lock);
+    
+    size_t kept = 0;
+    pthread_mutex_lock(&held_lock);
+    for (size_t i = 0; i < held; i++) {
+        HeldVersion version = root->held_versions[i];
+        if (!written[i]) {
+            root->held_versions[kept++] = version;
+            continue;
+        }
+        free(version.name);
+        free(version.location);
+    }
+    memmove(root->held_versions + kept, root->held_versions + held,
+            (root->held_count - held) * sizeof(HeldVersion));
+    root->held_count -= held - kept;
+    pthread_mutex_unlock(&held_lock);
+    free(written);
+    if (kept > 0 || sync_backup_directory() != 0) {
+        root->unsynced_backups = 1;  // Retry the lines left on the next call
+        return -1;
+    }
+    return 0;
+}
+
+// Group commit: sync the backups recorded since the last commit, then
+// write their records and every other one to the journal and sync it with
+// one fdatasync, so the journal never names a backup that is not on disk.
+// A commit with new backups waits until --sync-interval has passed since
+// the previous sync (finish_backups() retries it), so one sync covers the
+// backups of many checks; once a stop is requested it does not wait.
+// Records that cannot be written stay buffered for the next commit.
+// Compacts once the journal outgrows the snapshot.
+void journal_commit() {
+    if (!root->journal_dirty) {
+        return;
+    }
+    if (root->unsynced_backups > 0 && !stop_requested &&
+        monotonic_ns() < root->synced_ns + (int64_t)sync_interval_ms * 1000000) {
+        return;
+    }
+    
+    // A snapshot would record queued backups as written, so none is taken
+    // while any are in flight
+    if (!root->journal) {
+        if (backups_in_flight == 0 && save_state() == 0) {
+            root->journal_dirty = 0;
+        }
+        return;
+    }
+    if (sync_backups() != 0) {
+        return;  // Records stay held, retried on the next commit
+    }
+    
+    // The records stay buffered until they are on disk. A failed write is
+    // cut back off so a retry does not follow a torn record
+    int fd = fileno(root->journal);
+    off_t committed = lseek(fd, 0, SEEK_END);
+    if (committed < 0 || write_all(fd, root->journal_buffer, root->journal_length) != 0 ||
+        fdatasync(fd) != 0) {
+        fprintf(stderr, "[ERROR] Cannot sync state journal: %s\n", strerror(errno));
+        if (committed >= 0 && ftruncate(fd, committed) != 0) {
+            fprintf(stderr, "[WARN] Cannot trim state journal: %s\n", strerror(errno));
+        }
+        return;  // Retried on the next commit
+    }
+    root->journal_dirty = 0;
+    root->journal_length = 0;
+    if (root->journal_entries > JOURNAL_COMPACT_MIN && root->journal_entries > root->file_count &&
+        backups_in_flight == 0) {
+        compact_state();
+    }
+}
+
+// Write a snapshot of the whole table and empty the journal, dropping
+// held records too (the snapshot has them). Replaying a journal over a
+// snapshot that already contains its records is harmless, so a crash
+// between the two steps loses nothing.
+void compact_state() {
+    if (save_state() != 0) {
+        return;
+    }
+    if (root->journal) {
+        fflush(root->journal);
+        if (ftruncate(fileno(root->journal), 0) == 0) {
+            root->journal_entries = 0;
+            root->journal_length = 0;
+        }
+    }
+}
+
+// Set up the inotify instance; watches are added by the tree walker as
+// it visits each directory. Returns 0 on success, -1 to fall back to polling.
+int init_watcher() {
+#ifdef HAVE_INOTIFY
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        fprintf(stderr, "[WARN] inotify unavailable (%s), falling back to polling\n",
+                strerror(errno));
+        return -1;
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+// Watch a directory (relative to watch_directory) and remember its path
+// for the watch descriptor. Called concurrently from walker threads.
+void add_watch(const char *dir) {
+#ifdef HAVE_INOTIFY
+    if (inotify_fd < 0 || root->watch_failed) {
+        return;
+    }
+    
+    char path[MAX_PATH];
+    int fits = format_path(path, "%s/%s", root->watch_directory, dir) == 0;
+    
+    uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR;
+    if (recursive) {
+        mask |= IN_CREATE;  // Needed to pick up new subdirectories
+    }
+    int wd = fits ? inotify_add_watch(inotify_fd, path, mask) : -1;
+    
+    pthread_mutex_lock(&watch_lock);
+    if (wd < 0) {
+        if (!root->watch_failed) {
+            fprintf(stderr, "[WARN] Cannot watch %s (%s)\n", path, strerror(errno));
+        }
+        root->watch_failed = 1;
+    } else {
+        if (wd >= watch_path_count) {
+            int count = watch_path_count ? watch_path_count : 64;
+            while (count <= wd) count *= 2;
+            char **paths = realloc(watch_paths, count * sizeof(char *));
+            if (paths) watch_paths = paths;
+            Root **roots_grown = paths ? realloc(watch_roots, count * sizeof(Root *)) : NULL;
+            if (roots_grown) {
+                watch_roots = roots_grown;
+                memset(watch_paths + watch_path_count, 0,
+                       (count - watch_path_count) * sizeof(char *));
+                watch_path_count = count;
+            }
+        }
+        char *copy = wd < watch_path_count ? strdup(dir) : NULL;
+        if (copy) {
+            free(watch_paths[wd]);
+            watch_paths[wd] = copy;
+            watch_roots[wd] = root;
+        } else {
+            // Events for it could not be told apart, so stop trusting them
+            fprintf(stderr, "[ERROR] Out of memory watching %s\n", path);
+            root->watch_failed = 1;
+        }
+    }
+    pthread_mutex_unlock(&watch_lock);
+#else
+    (void)dir;
+#endif
+}
+
+// Move a root whose watch failed over to polling: drop its watches, so
+// the other roots keep their inotify events, and mark it for the poll
+// timer in watch_events()
+void poll_root(Root *r) {
+    fprintf(stderr, "[WARN] Not every directory in %s could be watched, polling it instead\n",
+            r->watch_directory);
+    r->watch_failed = 1;
+#ifdef HAVE_INOTIFY
+    for (int wd = 0; wd < watch_path_count; wd++) {
+        if (watch_paths[wd] && watch_roots[wd] == r) {
+            inotify_rm_watch(inotify_fd, wd);
+            free(watch_paths[wd]);
+            watch_paths[wd] = NULL;
+        }
+    }
+#endif
+}
+
+// Number of roots still served by inotify
+static int watched_roots() {
+    int count = 0;
+    for (int i = 0; i < root_count; i++) {
+        count += !roots[i].watch_failed;
+    }
+    return count;
+}
+
+// Check the changed files and track the new ones that a run of events
+// for the current root named, then empty the batch
+void flush_events(int *changed, size_t *changed_count, FoundFile *found, size_t *found_count) {
+    check_files(changed, *changed_count, 1);
+    track_files(found, *found_count);
+    for (size_t i = 0; i < *found_count; i++) {
+        free(found[i].name);
+    }
+    *changed_count = 0;
+    *found_count = 0;
+}
+
+// Drain pending inotify events and check only the files they name. A
+// root that loses its watch moves to polling on its own; returns -1 once
+// no root is watched any more.
+int process_events() {
+#ifdef HAVE_INOTIFY
+    char buffer[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len = read(inotify_fd, buffer, sizeof(buffer));
+    if (len < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    
+    // Files named in this read are collected and handled as one batch
+    // per run of events for the same root
+    int *changed = malloc(((size_t)len / sizeof(struct inotify_event) + 1) * sizeof(int));
+    FoundFile *found = malloc(((size_t)len / sizeof(struct inotify_event) + 1) * sizeof(FoundFile));
+    size_t changed_count = 0, found_count = 0;
+    int status = 0;
+    if (!changed || !found) {
+        free(changed);
+        free(found);
+        return -1;
+    }
+    Root *batch_root = root;
+    
+    for (char *p = buffer; p < buffer + len; ) {
+        struct inotify_event *event = (struct inotify_event *)p;
+        p += sizeof(struct inotify_event) + event->len;
+        
+        METRIC_ADD(events, 1);
+        if (event->mask & IN_Q_OVERFLOW) {
+            // Kernel dropped events - resync with a full pass
+            METRIC_ADD(events_dropped, 1);
+            fprintf(stderr, "[WARN] inotify queue overflow, rescanning\n");
+            flush_events(changed, &changed_count, found, &found_count);
+            Root *current = root;
+            for (int i = 0; i < root_count; i++) {
+                root = &roots[i];
+                scan_directory();
+                check_for_changes();
+            }
+            root = current;
+            continue;
+        }
+        
+        const char *dir = NULL;
+        if (event->wd >= 0 && event->wd < watch_path_count) {
+            dir = watch_paths[event->wd];
+        }
+        if (!dir) {
+            continue;
+        }
+        if (watch_roots[event->wd] != root) {
+            flush_events(changed, &changed_count, found, &found_count);
+            root = watch_roots[event->wd];
+        }
+        
+        if (event->mask & IN_IGNORED) {
+            // Watch removed: fatal for the root, routine for a subdirectory
+            if (dir[0] == '\0') {
+                flush_events(changed, &changed_count, found, &found_count);
+                poll_root(root);
+                continue;
+            }
+            free(watch_paths[event->wd]);
+            watch_paths[event->wd] = NULL;
+            continue;
+        }
+        if (event->len == 0 || event->name[0] == '.') {
+            continue;
+        }
+        
+        char name[MAX_PATH];
+        if (format_path(name, "%s%s%s", dir, dir[0] ? "/" : "", event->name) != 0) {
+            fprintf(stderr, "[WARN] Skipping %s/%s/%s: path too long\n",
+                    root->watch_directory, dir, event->name);
+            continue;
+        }
+        if (ignored(name, (event->mask & IN_ISDIR) != 0)) {
+            continue;
+        }
+        
+        if (event->mask & IN_ISDIR) {
+            // New or moved-in subdirectory: watch it and track its contents
+            if (recursive && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                if (walk_tree(name) != 0) {
+                    status = -1;
+                    break;
+                }
+                if (root->watch_failed) {
+                    flush_events(changed, &changed_count, found, &found_count);
+                    poll_root(root);
+                }
+            }
+            continue;
+        }
+        if (event->mask & IN_CREATE) {
+            continue;  // Wait for IN_CLOSE_WRITE
+        }
+        
+        int index = find_file(name);
+        if (index >= 0) {
+            changed[changed_count++] = index;
+        } else {
+            FoundFile *f = &found[found_count];
+            METRIC_ADD(files_statted, 1);
+            if (stat_at(root->watch_fd, name, &f->st) == 0 && S_ISREG(f->st.st_mode) &&
+                (max_file_size == 0 || f->st.st_size <= max_file_size)) {
+                f->name = strdup(name);
+                found_count++;
+            }
+        }
+    }
+    
+    flush_events(changed, &changed_count, found, &found_count);
+    root = batch_root;
+    free(changed);
+    free(found);
+    return watched_roots() > 0 ? status : -1;
+#else
+    return -1;
+#endif
+}
+
+// Block on inotify until something changes or a deferred check is due,
+// scanning the roots that could not be watched every poll interval;
+// returns when no root is watched any more
+void watch_events() {
+    struct pollfd pfd[2] = {
+        { .fd = inotify_fd, .events = POLLIN },
+        { .fd = wake_pipe[0], .events = POLLIN },  // Ignored while -1
+    };
+    
+    int64_t next_scan = monotonic_ns() + (int64_t)poll_interval * 1000000000;
+    while (1) {
+        int timeout = next_due_timeout();
+        if (watched_roots() < root_count) {
+            int scan = (int)((next_scan - monotonic_ns() + 999999) / 1000000);
+            if (scan < 0) scan = 0;
+            if (timeout < 0 || scan < timeout) timeout = scan;
+        }
+        int ready = poll(pfd, 2, timeout);
+        if (stop_requested) {
+            stop_watching();
+        }
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if ((pfd[0].revents & POLLIN) && process_events() < 0) {
+            break;
+        }
+        finish_backups();
+        if (monotonic_ns() >= next_scan) {
+            Root *current = root;
+            for (int i = 0; i < root_count; i++) {
+                if (roots[i].watch_failed) {
+                    root = &roots[i];
+                    scan_directory();
+                    poll_for_changes();
+                }
+            }
+            root = current;
+            next_scan = monotonic_ns() + (int64_t)poll_interval * 1000000000;
+        }
+        run_due_checks();
+    }
+    
+    fprintf(stderr, "[WARN] Lost inotify watch, falling back to polling\n");
+    close(inotify_fd);
+    inotify_fd = -1;
+}
+
+// Record one duration in a histogram
+void histogram_observe(Histogram *h, int64_t ns) {
+    double seconds = (double)ns / 1e9;
+    int bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS && seconds > histogram_bounds[bucket]) bucket++;
+    atomic_fetch_add_explicit(&h->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum_ns, (uint64_t)(ns > 0 ? ns : 0), memory_order_relaxed);
+}
 
-// Function prototypes
-void calculate_sha256(const char *filepath, char *output_hash);
-void scan_directory();
-void check_for_changes();
-void create_backup(const char *filepath, int version);
-int get_file_version(const char *filename);
-void load_state();
-void save_state();
-int is_backup_file(const char *filename);
-void create_backup_dir();
-char* get_timestamp();
-void print_status();
+// Publish the detector's table sizes for the metrics threads
+void update_gauges() {
+    int64_t files = 0, checks = 0;
+    for (int i = 0; i < root_count; i++) {
+        files += roots[i].file_count;
+        checks += (int64_t)roots[i].pending_count;
+    }
+    METRIC_SET(tracked_files, files);
+    METRIC_SET(pending_checks, checks);
+}
 
-// Calculate SHA-256 hash of a file (Modern OpenSSL 3.0+ way)
-void calculate_sha256(const char *filepath, char *output_hash) {
-    FILE *file = fopen(filepath, "rb");
-    if (!file) {
-        output_hash[0] = '\0';
-        return;
+// Open the --metrics listening socket: "unix:PATH" or a path containing
+// '/' is a Unix socket, anything else "[HOST:]PORT" over TCP (HOST
+// defaults to 127.0.0.1). Returns the socket or -1.
+int metrics_listen(const char *address) {
+    int fd;
+    const char *path = strncmp(address, "unix:", 5) == 0 ? address + 5
+                     : strchr(address, '/') ? address : NULL;
+    if (path) {
+        struct sockaddr_un sun;
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(sun.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(sun.sun_path, path);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        unlink(path);  // Left behind by an earlier run
+        if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0 || listen(fd, 16) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    
+    char host[256] = "127.0.0.1";
+    const char *port = address;
+    const char *colon = strrchr(address, ':');
+    if (colon) {
+        size_t len = (size_t)(colon - address);
+        if (address[0] == '[' && len >= 2 && address[len - 1] == ']') {
+            address++;  // [IPv6]:PORT
+            len -= 2;
+        }
+        if (len >= sizeof(host)) len = sizeof(host) - 1;
+        memcpy(host, address, len);
+        host[len] = '\0';
+        port = colon + 1;
+    }
+    
+    struct addrinfo hints, *result, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    int rc = getaddrinfo(host[0] ? host : NULL, port, &hints, &result);
+    if (rc != 0) {
+        fprintf(stderr, "[ERROR] Cannot resolve %s: %s\n", address, gai_strerror(rc));
+        errno = EINVAL;
+        return -1;
     }
+    fd = -1;
+    for (ai = result; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) continue;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 16) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    return fd;
+}
 
-    EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
-    if (!mdctx) {
-        fclose(file);
-        output_hash[0] = '\0';
-        return;
+// Write one histogram in the Prometheus text format (cumulative buckets)
+void write_histogram(FILE *f, const char *name, const char *help, Histogram *h) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    uint64_t cumulative = 0;
+    for (int i = 0; i <= HISTOGRAM_BUCKETS; i++) {
+        cumulative += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        if (i < HISTOGRAM_BUCKETS) {
+            fprintf(f, "%s_bucket{le=\"%g\"} %llu\n", name, histogram_bounds[i],
+                    (unsigned long long)cumulative);
+        } else {
+            fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)cumulative);
+        }
     }
+    fprintf(f, "%s_sum %.9f\n%s_count %llu\n",
+            name, (double)atomic_load_explicit(&h->sum_ns, memory_order_relaxed) / 1e9,
+            name, (unsigned long long)atomic_load_explicit(&h->count, memory_order_relaxed));
+}
 
-    EVP_DigestInit_ex(mdctx, EVP_sha256(), NULL);
+// Write every metric in the Prometheus text exposition format
+void write_metrics(FILE *f) {
+    static const struct {
+        const char *name;
+        const char *type;
+        const char *help;
+        size_t offset;
+        int is_gauge;
+    } values[] = {
+        { "autobackup_files_statted_total", "counter", "Files stat'ed by scans and checks",
+          offsetof(Metrics, files_statted), 0 },
+        { "autobackup_hashes_total", "counter", "Full content hashes computed",
+          offsetof(Metrics, hashes), 0 },
+        { "autobackup_read_bytes_total", "counter", "Bytes read to hash or fingerprint files",
+          offsetof(Metrics, bytes_read), 0 },
+        { "autobackup_backups_total", "counter", "Backups stored",
+          offsetof(Metrics, backups), 0 },
+        { "autobackup_backup_failures_total", "counter", "Backups that could not be stored",
+          offsetof(Metrics, backup_failures), 0 },
+        { "autobackup_backup_bytes_total", "counter", "Content bytes of stored backups",
+          offsetof(Metrics, backup_bytes), 0 },
+        { "autobackup_syncs_total", "counter", "File system syncs making backups durable",
+          offsetof(Metrics, syncs), 0 },
+        { "autobackup_events_total", "counter", "inotify events received",
+          offsetof(Metrics, events), 0 },
+        { "autobackup_events_dropped_total", "counter",
+          "inotify queue overflows (events lost, full rescan done)",
+          offsetof(Metrics, events_dropped), 0 },
+        { "autobackup_checks_deferred_total", "counter",
+          "Changed files deferred by debounce or rate limit",
+          offsetof(Metrics, checks_deferred), 0 },
+        { "autobackup_tracked_files", "gauge", "Files tracked",
+          offsetof(Metrics, tracked_files), 1 },
+        { "autobackup_pending_checks", "gauge", "Changed files waiting for debounce or rate limit",
+          offsetof(Metrics, pending_checks), 1 },
+        { "autobackup_backup_queue_depth", "gauge", "Backups queued or being written",
+          offsetof(Metrics, queue_depth), 1 },
+    };
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        void *field = (char *)&metrics + values[i].offset;
+        long long value = values[i].is_gauge
+            ? (long long)atomic_load_explicit((_Atomic int64_t *)field, memory_order_relaxed)
+            : (long long)atomic_load_explicit((_Atomic uint64_t *)field, memory_order_relaxed);
+        fprintf(f, "# HELP %s %s\n# TYPE %s %s\n%s %lld\n",
+                values[i].name, values[i].help, values[i].name, values[i].type,
+                values[i].name, value);
+    }
+    write_histogram(f, "autobackup_scan_duration_seconds",
+                    "Time to walk the watched tree for new files", &metrics.scan_duration);
+    write_histogram(f, "autobackup_check_duration_seconds",
+                    "Time to stat, hash and compare a batch of files", &metrics.check_duration);
+    write_histogram(f, "autobackup_backup_duration_seconds",
+                    "Time to store one backup", &metrics.backup_duration);
+}
 
-    unsigned char buffer[8192];
-    size_t bytes;
+// Answer one HTTP request: GET /metrics, anything else is a 404
+void serve_metrics(int client) {
+    char request[METRICS_REQUEST_MAX + 1];
+    size_t len = 0;
+    while (len < METRICS_REQUEST_MAX) {
+        ssize_t n = read(client, request + len, METRICS_REQUEST_MAX - len);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            break;
+        }
+        len += (size_t)n;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+    }
+    request[len] = '\0';
     
-    while ((bytes = fread(buffer, 1, sizeof(buffer), file)) > 0) {
-        EVP_DigestUpdate(mdctx, buffer, bytes);
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *f = open_memstream(&body, &body_len);
+    if (!f) {
+        return;
     }
+    int found = strncmp(request, "GET /metrics ", 13) == 0 ||
+                strncmp(request, "GET /metrics?", 13) == 0;
+    if (found) {
+        write_metrics(f);
+    } else {
+        fputs("Not found, try /metrics\n", f);
+    }
+    fclose(f);
+    
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 %s\r\n"
+                              "Content-Type: %s\r\n"
+                              "Content-Length: %zu\r\n"
+                              "Connection: close\r\n\r\n",
+                              found ? "200 OK" : "404 Not Found",
+                              found ? "text/plain; version=0.0.4" : "text/plain",
+                              body_len);
+    if (send_all(client, header, (size_t)header_len) == 0) {
+        send_all(client, body, body_len);
+    }
+    free(body);
+}
 
-    unsigned char hash[EVP_MAX_MD_SIZE];
-    unsigned int hash_len;
-    EVP_DigestFinal_ex(mdctx, hash, &hash_len);
-
-    EVP_MD_CTX_free(mdctx);
-    fclose(file);
+// Metrics thread: serve scrapes one at a time
+void *metrics_worker(void *arg) {
+    (void)arg;
+    while (1) {
+        int client = accept(metrics_fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "[WARN] Metrics endpoint stopped: %s\n", strerror(errno));
+            return NULL;
+        }
+        // A client that never finishes its request cannot hold up the others
+        struct timeval timeout = { .tv_sec = 2, .tv_usec = 0 };
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+        int one = 1;
+        setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+        serve_metrics(client);
+        close(client);
+    }
+}
 
-    // Convert to hex string
-    for (unsigned int i = 0; i < hash_len; i++) {
-        sprintf(output_hash + (i * 2), "%02x", hash[i]);
+// Stats thread: every stats_interval seconds print what happened since
+// the last line, and whether backups are keeping up
+void *stats_worker(void *arg) {
+    (void)arg;
+    uint64_t last_statted = 0, last_hashes = 0, last_read = 0, last_backups = 0;
+    uint64_t last_bytes = 0, last_failures = 0, last_dropped = 0;
+    uint64_t last_count = 0, last_sum = 0;
+    while (1) {
+        poll(NULL, 0, stats_interval * 1000);
+        uint64_t statted = METRIC_GET(files_statted), hashes = METRIC_GET(hashes);
+        uint64_t read_bytes = METRIC_GET(bytes_read), backups = METRIC_GET(backups);
+        uint64_t bytes = METRIC_GET(backup_bytes), failures = METRIC_GET(backup_failures);
+        uint64_t dropped = METRIC_GET(events_dropped);
+        uint64_t count = atomic_load(&metrics.backup_duration.count);
+        uint64_t sum = atomic_load(&metrics.backup_duration.sum_ns);
+        double avg_ms = count > last_count ? (double)(sum - last_sum) / (count - last_count) / 1e6 : 0;
+        
+        printf("[Stats] %ds: %llu stat'ed, %llu hashed (%.1f MB read), %llu backed up "
+               "(%.1f MB, avg %.2f ms), %llu failed, queue %lld, pending %lld, %llu overflows\n",
+               stats_interval,
+               (unsigned long long)(statted - last_statted),
+               (unsigned long long)(hashes - last_hashes),
+               (double)(read_bytes - last_read) / (1024.0 * 1024.0),
+               (unsigned long long)(backups - last_backups),
+               (double)(bytes - last_bytes) / (1024.0 * 1024.0), avg_ms,
+               (unsigned long long)(failures - last_failures),
+               (long long)METRIC_GET(queue_depth), (long long)METRIC_GET(pending_checks),
+               (unsigned long long)(dropped - last_dropped));
+        fflush(stdout);
+        last_statted = statted;
+        last_hashes = hashes;
+        last_read = read_bytes;
+        last_backups = backups;
+        last_bytes = bytes;
+        last_failures = failures;
+        last_dropped = dropped;
+        last_count = count;
+        last_sum = sum;
     }
-    output_hash[hash_len * 2] = '\0';
+    return NULL;
 }
 
-// Check if filename is a backup file (contains _v and timestamp)
-int is_backup_file(const char *filename) {
-    return strstr(filename, "_v") != NULL && strstr(filename, "_backup_") != NULL;
+// xorshift64* step, for generating benchmark data reproducibly
+uint64_t bench_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
 }
 
-// Get current version number for a file
-int get_file_version(const char *filename) {
-    for (int i = 0; i < file_count; i++) {
-        if (strcmp(tracked_files[i].filename, filename) == 0) {
-            return tracked_files[i].version;
-        }
+// Create a benchmark file of size bytes, cut from the random block
+int bench_write_file(const char *path, off_t size, const unsigned char *block) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
     }
-    return 0;
+    int failed = 0;
+    for (off_t done = 0; done < size && !failed; ) {
+        size_t part = size - done < LARGE_READ_SIZE ? (size_t)(size - done) : LARGE_READ_SIZE;
+        failed = write_all(fd, block + (done * 7919) % (LARGE_READ_SIZE - part + 1), part);
+        done += part;
+    }
+    if (close(fd) != 0) failed = -1;
+    return failed;
 }
 
-// Get formatted timestamp
-char* get_timestamp() {
-    static char timestamp[32];
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    strftime(timestamp, sizeof(timestamp), "%Y%m%d_%H%M%S", t);
-    return timestamp;
+// Wait until every queued backup is written and reaped
+void bench_wait_writers() {
+    while (backups_in_flight > 0) {
+        struct pollfd wake = { .fd = wake_pipe[0], .events = POLLIN };
+        poll(&wake, 1, 100);
+        finish_backups();
+    }
 }
 
-// Create backup directory if it doesn't exist
-void create_backup_dir() {
-    struct stat st = {0};
-    if (stat(backup_directory, &st) == -1) {
-        mkdir(backup_directory, 0755);
-        printf("[AutoBackup] Created backup directory: %s\n", backup_directory);
-    }
+static int compare_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
 }
 
-// Create a versioned backup of a file
-void create_backup(const char *filepath, int version) {
-    char backup_path[MAX_PATH];
-    char *filename = strrchr(filepath, '/');
-    filename = filename ? filename + 1 : (char*)filepath;
-    
-    // Extract name and extension
-    char name[MAX_PATH], ext[MAX_PATH];
-    char *dot = strrchr(filename, '.');
+static double ms_between(int64_t start, int64_t end) {
+    return (double)(end - start) / 1e6;
+}
+
+static double mb_per_second(long long bytes, int64_t ns) {
+    return ns > 0 ? (double)bytes / (1024.0 * 1024.0) / ((double)ns / 1e9) : 0.0;
+}
+
+// --bench: fill watch_directory (a fresh scratch directory) with
+// bench_files files averaging bench_size bytes, then time the initial
+// scan, plain hashing, and BENCH_ROUNDS rounds of changing bench_change
+// percent of the files and backing them up, with the configured options.
+// Per-file messages are discarded while a phase runs. Returns 0 on success.
+int run_benchmark() {
+    unsigned char *block = malloc(LARGE_READ_SIZE);
+    int changes = (int)((long long)bench_files * bench_change / 100);
+    if (changes < 1) changes = 1;
+    bench_latency_capacity = (size_t)changes * BENCH_ROUNDS;
+    bench_latencies = malloc(bench_latency_capacity * sizeof(int64_t));
+    if (!block || !bench_latencies) {
+        fprintf(stderr, "[ERROR] Out of memory setting up the benchmark\n");
+        return -1;
+    }
+    uint64_t rng = 0x9E3779B97F4A7C15ULL;
+    for (size_t i = 0; i < LARGE_READ_SIZE; i += 8) {
+        uint64_t r = bench_random(&rng);
+        memcpy(block + i, &r, 8);
+    }
     
-    if (dot) {
-        size_t name_len = dot - filename;
-        if (name_len >= MAX_PATH) name_len = MAX_PATH - 1;
-        strncpy(name, filename, name_len);
-        name[name_len] = '\0';
-        strncpy(ext, dot, MAX_PATH - 1);
-        ext[MAX_PATH - 1] = '\0';
-    } else {
-        strncpy(name, filename, MAX_PATH - 1);
-        name[MAX_PATH - 1] = '\0';
-        ext[0] = '\0';
+    // Sizes: nine in ten files up to bench_size, the rest up to ten times
+    // it, so the mean is close to bench_size with a long tail
+    long long total_bytes = 0;
+    off_t largest = 0;
+    printf("[Bench] Generating %d files in %s...\n", bench_files, root->watch_directory);
+    for (int i = 0; i < bench_files; i++) {
+        uint64_t r = bench_random(&rng);
+        long long span = r % 10 == 0 ? bench_size * 10 - bench_size : bench_size;
+        long long base = r % 10 == 0 ? bench_size : 1;
+        off_t size = (off_t)(base + (long long)((r >> 8) % (uint64_t)span));
+        total_bytes += size;
+        if (size > largest) largest = size;
+        
+        char path[MAX_PATH];
+        int fits;
+        if (recursive) {
+            fits = format_path(path, "%s/d%04d", root->watch_directory, i / BENCH_DIR_FILES) == 0;
+            if (fits && i % BENCH_DIR_FILES == 0) make_dirs(path);
+            fits = fits && format_path(path, "%s/d%04d/f%07d.dat", root->watch_directory,
+                                       i / BENCH_DIR_FILES, i) == 0;
+        } else {
+            fits = format_path(path, "%s/f%07d.dat", root->watch_directory, i) == 0;
+        }
+        if (!fits || bench_write_file(path, size, block) != 0) {
+            fprintf(stderr, "[ERROR] Cannot write %s: %s\n", path, strerror(errno));
+            return -1;
+        }
     }
     
-    // Create backup filename: name_v1_backup_20240101_120000.ext
-    snprintf(backup_path, MAX_PATH - 1, "%s/%s_v%d_backup_%s%s",
-             backup_directory, name, version, get_timestamp(), ext);
+    // Phase output goes to /dev/null, the report to the real stdout
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (saved_stdout < 0 || null_fd < 0) {
+        fprintf(stderr, "[ERROR] Cannot redirect output: %s\n", strerror(errno));
+        return -1;
+    }
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
     
-    // Copy file
-    FILE *src = fopen(filepath, "rb");
-    FILE *dst = fopen(backup_path, "wb");
+    int64_t scan_start = monotonic_ns();
+    if (scan_directory() != 0) {
+        fflush(stdout);
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+        return -1;
+    }
+    int64_t scan_end = monotonic_ns();
     
-    if (!src || !dst) {
-        if (src) fclose(src);
-        if (dst) fclose(dst);
-        fprintf(stderr, "[ERROR] Failed to create backup: %s\n", backup_path);
-        return;
+    long long hashed_bytes = 0;
+    int hashed = 0;
+    int64_t hash_start = monotonic_ns();
+    for (int i = 0; i < root->file_count; i++) {
+        char path[MAX_PATH];
+        unsigned char hash[HASH_LEN];
+        if (format_path(path, "%s/%s", root->watch_directory, root->tracked_files[i].filename) == 0 &&
+            calculate_hash(path, hash_algo, hash) == 0) {
+            hashed++;
+            hashed_bytes += (long long)root->tracked_files[i].size;
+        }
     }
+    int64_t hash_end = monotonic_ns();
     
-    char buffer[8192];
-    size_t bytes;
-    while ((bytes = fread(buffer, 1, sizeof(buffer), src)) > 0) {
-        fwrite(buffer, 1, bytes, dst);
+    double detect_ms[BENCH_ROUNDS], written_ms[BENCH_ROUNDS];
+    int64_t backup_ns = 0;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        for (int c = 0; c < changes; c++) {
+            int i = (int)(bench_random(&rng) % (uint64_t)root->file_count);
+            char path[MAX_PATH];
+            int fd = format_path(path, "%s/%s", root->watch_directory,
+                                 root->tracked_files[i].filename) == 0
+                         ? open(path, O_WRONLY | O_CLOEXEC) : -1;
+            if (fd < 0) continue;
+            off_t size = (off_t)root->tracked_files[i].size;
+            size_t len = size < BENCH_WRITE_SIZE ? (size_t)size : BENCH_WRITE_SIZE;
+            off_t offset = (off_t)(bench_random(&rng) % (uint64_t)(size - (off_t)len + 1));
+            if (pwrite(fd, block + bench_random(&rng) % (LARGE_READ_SIZE - len), len, offset) < 0) {
+                fprintf(stderr, "[WARN] Cannot modify %s: %s\n", path, strerror(errno));
+            }
+            close(fd);
+        }
+        
+        int64_t start = monotonic_ns();
+        check_for_changes();
+        int64_t detected = monotonic_ns();
+        bench_wait_writers();
+        int64_t written = monotonic_ns();
+        detect_ms[round] = ms_between(start, detected);
+        written_ms[round] = ms_between(start, written);
+        backup_ns += written - start;
     }
     
-    fclose(src);
-    fclose(dst);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    long long peak_rss_kb = (long long)usage.ru_maxrss / 1024;
+#else
+    long long peak_rss_kb = (long long)usage.ru_maxrss;
+#endif
+    
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    
+    size_t backups = atomic_load(&bench_latency_count);
+    if (backups > bench_latency_capacity) backups = bench_latency_capacity;
+    qsort(bench_latencies, backups, sizeof(int64_t), compare_int64);
+    
+    printf("\n=== AutoBackupWatch Benchmark ===\n");
+    printf("Files: %d, %.1f MB (mean %lld KB, largest %lld KB), %d%% changed per round\n",
+           bench_files, (double)total_bytes / (1024.0 * 1024.0),
+           total_bytes / bench_files / 1024, (long long)largest / 1024, bench_change);
+    printf("Hash: %s, I/O engine: %s, writers: %d, store: %s, compression: %s\n",
+           hash_algo_names[hash_algo], use_uring ? "io_uring" : "blocking", writer_count,
+           chunked ? "chunked" : dedup ? "dedup" : single_pass ? "plain, single-pass" : "plain",
+           codec_names[compress_codec]);
+    printf("(warm page cache: the files were just written)\n\n");
+    printf("scan_directory      %10.1f ms  %10.0f files/s  %8.1f MB/s  (tracks and hashes every file)\n",
+           ms_between(scan_start, scan_end),
+           root->file_count / ((double)(scan_end - scan_start) / 1e9),
+           mb_per_second(total_bytes, scan_end - scan_start));
+    printf("calculate_hash      %10.1f ms  %10.0f hashes/s %8.1f MB/s\n",
+           ms_between(hash_start, hash_end),
+           hashed / ((double)(hash_end - hash_start) / 1e9),
+           mb_per_second(hashed_bytes, hash_end - hash_start));
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        printf("check_for_changes   %10.1f ms  (round %d: %d changes, all written after %.1f ms)\n",
+               detect_ms[round], round + 1, changes, written_ms[round]);
+    }
+    if (backups > 0) {
+        printf("create_backup       %zu backups, latency p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+               backups,
+               bench_latencies[backups / 2] / 1e6,
+               bench_latencies[backups * 90 / 100] / 1e6,
+               bench_latencies[backups * 99 / 100] / 1e6,
+               bench_latencies[backups - 1] / 1e6);
+        printf("                    %.1f MB copied, %.1f MB/s from first check to last write\n",
+               (double)atomic_load(&bench_bytes_copied) / (1024.0 * 1024.0),
+               mb_per_second(atomic_load(&bench_bytes_copied), backup_ns));
+    }
+    printf("Peak RSS            %10.1f MB\n", peak_rss_kb / 1024.0);
     
-    printf("✓ Backed up: %s → v%d (hash changed)\n", filename, version);
+    free(block);
+    return 0;
 }
 
-// Scan directory and update file tracking
-void scan_directory() {
-    DIR *dir = opendir(watch_directory);
-    if (!dir) {
-        fprintf(stderr, "[ERROR] Cannot open directory: %s\n", watch_directory);
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)type;
+    (void)ftw;
+    return remove(path) == 0 ? 0 : -1;
+}
+
+// Delete a directory tree (the benchmark's scratch directory)
+int remove_tree(const char *path) {
+    return nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+// --self-test: failed checks so far
+static int self_test_failures = 0;
+
+// Record one self-test check, reporting it if it failed
+static void self_check(int ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "[FAIL] %s\n", what);
+        self_test_failures++;
+    }
+}
+
+// Connect to the metrics socket at path, send a scrape request and either
+// hang up at once or read the whole response into response
+static int self_test_scrape(const char *path, char *response, size_t size) {
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        return -1;
+    }
+    strcpy(sun.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    int failed = write_all(fd, request, sizeof(request) - 1);
+    size_t len = 0;
+    ssize_t n;
+    while (!failed && response && len + 1 < size &&
+           (n = read(fd, response + len, size - 1 - len)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            failed = -1;
+            break;
+        }
+        len += (size_t)n;
+    }
+    if (response) response[len] = '\0';
+    close(fd);
+    return failed;
+}
+
+// A scrape client that hangs up before reading the response must not
+// take the process down with SIGPIPE, and later scrapes must still work
+static void self_test_metrics() {
+    char path[MAX_PATH], what[MAX_PATH + 64];
+    format_path(path, "/tmp/autobackup-selftest-%d.sock", (int)getpid());
+    snprintf(what, sizeof(what), "metrics: listen on unix:%s", path);
+    metrics_fd = metrics_listen(path);
+    pthread_t server;
+    if (metrics_fd < 0 || pthread_create(&server, NULL, metrics_worker, NULL) != 0) {
+        self_check(0, what);
         return;
     }
+    pthread_detach(server);
     
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip directories, hidden files, and backup files
-        if (entry->d_type == DT_DIR || entry->d_name[0] == '.' || 
-            is_backup_file(entry->d_name)) {
-            continue;
-        }
-        
-        char filepath[MAX_PATH];
-        snprintf(filepath, MAX_PATH - 1, "%s/%s", watch_directory, entry->d_name);
-        
-        struct stat file_stat;
-        if (stat(filepath, &file_stat) != 0) {
-            continue;
-        }
-        
-        // Check if file is already tracked
-        int found = 0;
-        for (int i = 0; i < file_count; i++) {
-            if (strcmp(tracked_files[i].filename, entry->d_name) == 0) {
-                found = 1;
-                break;
-            }
-        }
-        
-        // Add new file to tracking
-        if (!found && file_count < MAX_FILES) {
-            strncpy(tracked_files[file_count].filename, entry->d_name, MAX_PATH - 1);
-            tracked_files[file_count].filename[MAX_PATH - 1] = '\0';
-            calculate_sha256(filepath, tracked_files[file_count].hash);
-            tracked_files[file_count].last_modified = file_stat.st_mtime;
-            tracked_files[file_count].version = 1;
-            printf("[AutoBackup] Now tracking: %s\n", entry->d_name);
-            file_count++;
+    for (int i = 0; i < 50; i++) {
+        self_test_scrape(path, NULL, 0);
+    }
+    char *response = malloc(1 << 20);
+    self_check(response && self_test_scrape(path, response, 1 << 20) == 0 &&
+               strncmp(response, "HTTP/1.0 200 OK", 15) == 0,
+               "metrics: scrape after clients hung up early");
+    free(response);
+    unlink(path);
+}
+
+// glob_match() on its own
+static void self_test_glob() {
+    static const struct { const char *pattern, *text; int match; } cases[] = {
+        { "*.log", "a.log", 1 },
+        { "*.log", "dir/a.log", 0 },        // '*' does not cross '/'
+        { "a?c", "abc", 1 },
+        { "a?c", "a/c", 0 },
+        { "**/build", "build", 1 },
+        { "**/build", "x/y/build", 1 },
+        { "**/build", "xbuild", 0 },
+        { "docs/**", "docs/a/b.pdf", 1 },
+        { "a/**/b", "a/b", 1 },
+        { "a/**/b", "a/x/y/b", 1 },
+        { "[ab].txt", "b.txt", 1 },
+        { "[ab].txt", "c.txt", 0 },
+        { "[!ab].txt", "c.txt", 1 },
+        { "[!ab].txt", "a.txt", 0 },
+        { "[a-c]x", "bx", 1 },
+        { "[a-c]x", "dx", 0 },
+        { "[a-]x", "-x", 1 },
+        { "[]]x", "]x", 1 },                // Leading ']' is a member
+        { "[]a]x", "ax", 1 },
+        { "[!]]x", "ax", 1 },
+        { "[!]]x", "]x", 0 },
+        { "[]", "[]", 1 },                  // No closing ']': literal '['
+        { "[!]", "[!]", 1 },
+        { "[", "[", 1 },
+        { "x[", "x", 0 },
+        { "\\*", "*", 1 },
+        { "\\*", "a", 0 },
+    };
+    char what[256];
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        snprintf(what, sizeof(what), "glob_match(\"%s\", \"%s\") should be %d",
+                 cases[i].pattern, cases[i].text, cases[i].match);
+        self_check(glob_match(cases[i].pattern, cases[i].text) == cases[i].match, what);
+    }
+}
+
+// Ignore files through add_ignore_rule() and ignored()
+static void self_test_ignore() {
+    static const char *lines[] = {
+        "# comment", "", "*.tmp", "!keep.tmp", "build/", "/*.log", "/dist",
+        "docs/**/*.pdf", "**/cache", "\\#literal", "lib*",
+    };
+    static const struct { const char *path; int is_dir, ignored; } cases[] = {
+        { "a.tmp", 0, 1 },
+        { "sub/a.tmp", 0, 1 },
+        { "keep.tmp", 0, 0 },               // Negation, later rule wins
+        { "sub/keep.tmp", 0, 0 },
+        { "build", 1, 1 },
+        { "build", 0, 0 },                  // "dir/" only matches directories
+        { "sub/build", 1, 1 },
+        { "top.log", 0, 1 },
+        { "sub/keep.log", 0, 0 },           // "/*.log" is anchored to the root
+        { "dist", 1, 1 },
+        { "sub/dist", 1, 0 },
+        { "docs/a/b.pdf", 0, 1 },
+        { "docs/b.pdf", 0, 1 },
+        { "b.pdf", 0, 0 },
+        { "x/y/cache", 1, 1 },
+        { "#literal", 0, 1 },
+        { "libfoo", 0, 1 },
+        { "sub/libfoo", 0, 1 },
+        { "README", 0, 0 },
+    };
+    Root test;
+    Root *saved = root;
+    memset(&test, 0, sizeof(test));
+    root = &test;
+    for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+        self_check(add_ignore_rule(&root->ignore, lines[i]) == 0, "add_ignore_rule: out of memory");
+    }
+    char what[256];
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        snprintf(what, sizeof(what), "ignored(\"%s\"%s) should be %d", cases[i].path,
+                 cases[i].is_dir ? ", dir" : "", cases[i].ignored);
+        self_check(ignored(cases[i].path, cases[i].is_dir) == cases[i].ignored, what);
+    }
+    for (size_t i = 0; i < root->ignore.count; i++) free(root->ignore.rules[i].pattern);
+    free(root->ignore.rules);
+    root = saved;
+}
+
+// parse_point() for each --at form
+static void self_test_points() {
+    struct tm tm = {0};
+    tm.tm_year = 2024 - 1900;
+    tm.tm_mon = 9;
+    tm.tm_mday = 30;
+    tm.tm_hour = 14;
+    tm.tm_min = 55;
+    tm.tm_isdst = -1;
+    time_t local = mktime(&tm);
+    time_t now = time(NULL);
+    static const struct { const char *spec; int ok, version; } cases[] = {
+        { "v3", 1, 3 }, { "v0", 0, 0 }, { "v", 0, 0 }, { "v3x", 0, 0 },
+        { "@1700000000", 1, 0 }, { "@", 0, 0 }, { "@12x", 0, 0 },
+        { "2024-10-30 14:55", 1, 0 }, { "2024-10-30T14:55:00", 1, 0 },
+        { "2024-10-30", 1, 0 }, { "2024-10-30 14", 0, 0 },
+        { "90", 1, 0 }, { "2h", 1, 0 }, { "1w", 1, 0 }, { "5x", 0, 0 },
+        { "2hh", 0, 0 }, { "-1d", 0, 0 }, { "bogus", 0, 0 }, { "", 0, 0 },
+    };
+    char what[256];
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        time_t at = 0;
+        int version = 0;
+        int ok = parse_point(cases[i].spec, &at, &version) == 0;
+        snprintf(what, sizeof(what), "parse_point(\"%s\") should %s", cases[i].spec,
+                 cases[i].ok ? "parse" : "be rejected");
+        self_check(ok == cases[i].ok, what);
+        if (ok && cases[i].ok) {
+            snprintf(what, sizeof(what), "parse_point(\"%s\") version", cases[i].spec);
+            self_check(version == cases[i].version, what);
         }
     }
     
-    closedir(dir);
+    // The values of the time forms
+    time_t at = 0;
+    int version = 0;
+    self_check(parse_point("@1700000000", &at, &version) == 0 && at == 1700000000,
+               "parse_point(\"@1700000000\") value");
+    self_check(parse_point("2024-10-30T14:55", &at, &version) == 0 && at == local,
+               "parse_point(\"2024-10-30T14:55\") is local time");
+    self_check(parse_point("2h", &at, &version) == 0 && at >= now - 7200 && at <= now - 7198,
+               "parse_point(\"2h\") is two hours ago");
 }
 
-// Check for file changes and create backups
-void check_for_changes() {
-    for (int i = 0; i < file_count; i++) {
-        char filepath[MAX_PATH];
-        snprintf(filepath, MAX_PATH - 1, "%s/%s", 
-                 watch_directory, tracked_files[i].filename);
-        
-        struct stat file_stat;
-        if (stat(filepath, &file_stat) != 0) {
-            // File deleted or inaccessible
-            continue;
-        }
-        
-        // Only check if modified time changed (optimization)
-        if (file_stat.st_mtime <= tracked_files[i].last_modified) {
-            continue;
-        }
-        
-        // Calculate new hash
-        char new_hash[HASH_SIZE];
-        calculate_sha256(filepath, new_hash);
-        
-        // Compare hashes (detects actual content changes)
-        if (strcmp(new_hash, tracked_files[i].hash) != 0) {
-            // Content changed - create backup
-            tracked_files[i].version++;
-            create_backup(filepath, tracked_files[i].version);
-            
-            // Update tracking info
-            strncpy(tracked_files[i].hash, new_hash, HASH_SIZE - 1);
-            tracked_files[i].hash[HASH_SIZE - 1] = '\0';
-            tracked_files[i].last_modified = file_stat.st_mtime;
-            
-            save_state();
-        }
+// --self-test: run the built-in checks. Returns the number that failed.
+int run_self_test() {
+    self_test_glob();
+    self_test_ignore();
+    self_test_points();
+    self_test_metrics();
+    if (self_test_failures == 0) {
+        printf("[AutoBackup] Self-test passed\n");
+    } else {
+        printf("[AutoBackup] Self-test: %d check(s) failed\n", self_test_failures);
     }
+    return self_test_failures;
 }
 
-// Save tracking state to file
-void save_state() {
-    char state_file[MAX_PATH];
-    snprintf(state_file, MAX_PATH - 1, "%s/.autobackup_state", watch_directory);
-    
-    FILE *f = fopen(state_file, "w");
-    if (!f) return;
-    
-    fprintf(f, "%d\n", file_count);
-    for (int i = 0; i < file_count; i++) {
-        fprintf(f, "%s|%s|%ld|%d\n",
-                tracked_files[i].filename,
-                tracked_files[i].hash,
-                (long)tracked_files[i].last_modified,
-                tracked_files[i].version);
+// Add a directory to roots (trailing slash removed). Returns -1 if out
+// of memory or the path is too long.
+int add_root(const char *dir) {
+    size_t len = strlen(dir);
+    while (len > 1 && dir[len - 1] == '/') len--;
+    if (len == 0 || len >= MAX_PATH - 64) {
+        fprintf(stderr, "[ERROR] Invalid directory: %s\n", dir);
+        return -1;
     }
-    
-    fclose(f);
+    // Threads hold pointers into roots, so it only grows before any start
+    Root *grown = realloc(roots, (root_count + 1) * sizeof(Root));
+    if (!grown) {
+        fprintf(stderr, "[ERROR] Out of memory adding %s\n", dir);
+        return -1;
+    }
+    roots = grown;
+    Root *r = &roots[root_count++];
+    memset(r, 0, sizeof(*r));
+    memcpy(r->watch_directory, dir, len);
+    r->watch_directory[len] = '\0';
+    r->watch_fd = -1;
+    return 0;
 }
 
-// Load tracking state from file
-void load_state() {
-    char state_file[MAX_PATH];
-    snprintf(state_file, MAX_PATH - 1, "%s/.autobackup_state", watch_directory);
-    
-    FILE *f = fopen(state_file, "r");
-    if (!f) return;
+// Read the --config file: one directory to watch per line; blank lines
+// and lines starting with '#' are skipped. Returns -1 on error or if it
+// names no directory.
+int load_config(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "[ERROR] Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
     
-    if (fscanf(f, "%d\n", &file_count) != 1) {
-        file_count = 0;
-        fclose(f);
-        return;
+    char line[MAX_PATH];
+    int status = 0;
+    while (status == 0 && fgets(line, sizeof(line), f)) {
+        char *start = line;
+        while (isspace((unsigned char)*start)) start++;
+        char *end = start + strlen(start);
+        while (end > start && isspace((unsigned char)end[-1])) end--;
+        *end = '\0';
+        if (*start == '\0' || *start == '#') {
+            continue;
+        }
+        status = add_root(start);
     }
+    fclose(f);
     
-    for (int i = 0; i < file_count && i < MAX_FILES; i++) {
-        long mtime;
-        if (fscanf(f, "%[^|]|%[^|]|%ld|%d\n",
-               tracked_files[i].filename,
-               tracked_files[i].hash,
-               &mtime,
-               &tracked_files[i].version) == 4) {
-            tracked_files[i].last_modified = (time_t)mtime;
+    if (status == 0 && root_count == 0) {
+        fprintf(stderr, "[ERROR] No directories to watch in %s\n", path);
+        status = -1;
+    }
+    return status;
+}
+
+// Open the current root's directory and create its backup directory
+int open_root() {
+    struct stat st;
+    if (stat(root->watch_directory, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "[ERROR] Invalid directory: %s\n", root->watch_directory);
+        return -1;
+    }
+    for (Root *r = roots; r < root; r++) {
+        struct stat other;
+        if (fstat(r->watch_fd, &other) == 0 && other.st_dev == st.st_dev &&
+            other.st_ino == st.st_ino) {
+            fprintf(stderr, "[ERROR] %s is already watched as %s\n",
+                    root->watch_directory, r->watch_directory);
+            return -1;
         }
     }
     
-    fclose(f);
-    printf("[AutoBackup] Loaded state: tracking %d files\n", file_count);
+    root->watch_fd = open(root->watch_directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root->watch_fd < 0) {
+        fprintf(stderr, "[ERROR] Cannot open %s: %s\n", root->watch_directory, strerror(errno));
+        return -1;
+    }
+    if (format_path(root->backup_directory, "%s/%s", root->watch_directory, BACKUP_DIR) != 0) {
+        fprintf(stderr, "[ERROR] Invalid directory: %s\n", root->watch_directory);
+        return -1;
+    }
+    create_backup_dir();
+    return 0;
+}
+
+// Prepare the current root's staging directory and load its state and
+// journal
+int load_root() {
+    if (format_path(root->staging_directory, "%s/%s", root->backup_directory, STAGING_DIR) != 0 ||
+        make_dirs(root->staging_directory) != 0) {
+        fprintf(stderr, "[ERROR] Cannot create %s: %s\n", root->staging_directory, strerror(errno));
+        return -1;
+    }
+    clean_staging();
+    if (load_ignore_rules() != 0) {
+        fprintf(stderr, "[ERROR] Out of memory loading ignore rules\n");
+        return -1;
+    }
+    load_state();
+    forget_ignored_files();
+    open_journal();
+    return 0;
 }
 
 // Print current status
 void print_status() {
     printf("\n=== AutoBackupWatch Status ===\n");
-    printf("Watching: %s\n", watch_directory);
-    printf("Tracking %d file(s):\n", file_count);
+    printf("Watching: %s\n", root->watch_directory);
+    printf("Tracking %d file(s):\n", root->file_count);
     
-    for (int i = 0; i < file_count; i++) {
+    for (int i = 0; i < root->file_count; i++) {
         printf("  • %s (v%d)\n", 
-               tracked_files[i].filename, 
-               tracked_files[i].version);
+               root->tracked_files[i].filename, 
+               root->tracked_files[i].version);
     }
     printf("=============================\n\n");
 }
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("Usage: %s <directory_to_watch> [poll_interval_seconds]\n", argv[0]);
+    static const struct option long_options[] = {
+        { "poll", no_argument, NULL, 'p' },
+        { "recursive", no_argument, NULL, 'r' },
+        { "threads", required_argument, NULL, 't' },
+        { "hash", required_argument, NULL, 'H' },
+        { "single-pass", no_argument, NULL, 'S' },
+        { "dedup", no_argument, NULL, 'D' },
+        { "chunked", no_argument, NULL, 'C' },
+        { "debounce", required_argument, NULL, 'B' },
+        { "rate-limit", required_argument, NULL, 'R' },
+        { "max-poll", required_argument, NULL, 'M' },
+        { "io-uring", no_argument, NULL, 'U' },
+        { "keep-last", required_argument, NULL, 'K' },
+        { "keep-hourly", required_argument, NULL, 'O' },
+        { "keep-daily", required_argument, NULL, 'Y' },
+        { "keep-weekly", required_argument, NULL, 'W' },
+        { "max-bytes", required_argument, NULL, 'X' },
+        { "migrate-layout", no_argument, NULL, 'G' },
+        { "sample-large", no_argument, NULL, 'Z' },
+        { "compress", required_argument, NULL, 'c' },
+        { "writers", required_argument, NULL, 'w' },
+        { "bench", no_argument, NULL, 'b' },
+        { "metrics", required_argument, NULL, 'm' },
+        { "stats-interval", required_argument, NULL, 's' },
+        { "bench-files", required_argument, NULL, 'n' },
+        { "bench-size", required_argument, NULL, 'e' },
+        { "bench-change", required_argument, NULL, 'g' },
+        { "config", required_argument, NULL, 'f' },
+        { "exclude", required_argument, NULL, 'x' },
+        { "max-file-size", required_argument, NULL, 'z' },
+        { "io-limit", required_argument, NULL, 'l' },
+        { "iops-limit", required_argument, NULL, 'i' },
+        { "io-idle", no_argument, NULL, 'I' },
+        { "drop-cache", no_argument, NULL, 'd' },
+        { "log", no_argument, NULL, 'L' },
+        { "restore", no_argument, NULL, 'T' },
+        { "at", required_argument, NULL, 'a' },
+        { "restore-to", required_argument, NULL, 'o' },
+        { "sync-interval", required_argument, NULL, 'y' },
+        { "self-test", no_argument, NULL, 'q' },
+        { NULL, 0, NULL, 0 }
+    };
+    int use_polling = 0;
+    int migrate = 0;
+    int bench = 0;
+    int query_log = 0, query_restore = 0;
+    time_t query_at = 0;
+    int query_version = 0, query_point = 0;
+    const char *restore_to = NULL;
+    const char *config_file = NULL;
+    int opt;
+    
+    worker_threads = default_threads();
+    
+    while ((opt = getopt_long(argc, argv, "rt:H:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'p':
+            use_polling = 1;
+            break;
+        case 'f':
+            config_file = optarg;
+            break;
+        case 'r':
+            recursive = 1;
+            break;
+        case 't':
+            worker_threads = atoi(optarg);
+            if (worker_threads < 1) worker_threads = 1;
+            if (worker_threads > MAX_THREADS) worker_threads = MAX_THREADS;
+            break;
+        case 'H': {
+            int algo = parse_hash_algo(optarg);
+            if (algo < 0) {
+                fprintf(stderr, "[ERROR] Unknown or unavailable hash algorithm: %s\n", optarg);
+                return 1;
+            }
+            hash_algo = (HashAlgo)algo;
+            break;
+        }
+        case 'S':
+            single_pass = 1;
+            break;
+        case 'D':
+            dedup = 1;
+            break;
+        case 'C':
+            chunked = 1;
+            break;
+        case 'B':
+            debounce_ms = atoi(optarg);
+            if (debounce_ms < 0) debounce_ms = 0;
+            break;
+        case 'R':
+            rate_limit_seconds = atoi(optarg);
+            if (rate_limit_seconds < 0) rate_limit_seconds = 0;
+            break;
+        case 'M':
+            max_poll_interval = atoi(optarg);
+            break;
+        case 'U':
+            use_uring = 1;
+            break;
+        case 'K':
+            keep_last = atoi(optarg);
+            break;
+        case 'O':
+            keep_hourly = atoi(optarg);
+            break;
+        case 'Y':
+            keep_daily = atoi(optarg);
+            break;
+        case 'W':
+            keep_weekly = atoi(optarg);
+            break;
+        case 'G':
+            migrate = 1;
+            break;
+        case 'Z':
+            sample_large = 1;
+            break;
+        case 'b':
+            bench = 1;
+            break;
+        case 'm':
+            metrics_address = optarg;
+            break;
+        case 's':
+            stats_interval = atoi(optarg);
+            if (stats_interval < 0) stats_interval = 0;
+            break;
+        case 'n':
+            bench_files = atoi(optarg);
+            if (bench_files < 1) bench_files = 1;
+            break;
+        case 'e':
+            bench_size = parse_size(optarg);
+            if (bench_size < 1) {
+                fprintf(stderr, "[ERROR] Invalid size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'g':
+            bench_change = atoi(optarg);
+            if (bench_change < 0) bench_change = 0;
+            if (bench_change > 100) bench_change = 100;
+            break;
+        case 'x': {
+            char **grown = realloc(exclude_patterns, (exclude_count + 1) * sizeof(char *));
+            if (!grown) {
+                fprintf(stderr, "[ERROR] Out of memory\n");
+                return 1;
+            }
+            exclude_patterns = grown;
+            exclude_patterns[exclude_count++] = optarg;
+            break;
+        }
+        case 'z':
+            max_file_size = parse_size(optarg);
+            if (max_file_size < 0) {
+                fprintf(stderr, "[ERROR] Invalid size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'l':
+            io_limit = parse_size(optarg);
+            if (io_limit < 0) {
+                fprintf(stderr, "[ERROR] Invalid rate: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'i':
+            iops_limit = atoi(optarg);
+            if (iops_limit < 0) iops_limit = 0;
+            break;
+        case 'I':
+            io_idle = 1;
+            break;
+        case 'd':
+            drop_cache = 1;
+            break;
+        case 'L':
+            query_log = 1;
+            break;
+        case 'T':
+            query_restore = 1;
+            break;
+        case 'a':
+            if (parse_point(optarg, &query_at, &query_version) != 0) {
+                fprintf(stderr, "[ERROR] Invalid point in time: %s\n", optarg);
+                return 1;
+            }
+            query_point = 1;
+            break;
+        case 'o':
+            restore_to = optarg;
+            break;
+        case 'q':
+            return run_self_test() == 0 ? 0 : 1;
+        case 'y':
+            sync_interval_ms = atoi(optarg);
+            if (sync_interval_ms < 0) sync_interval_ms = 0;
+            break;
+        case 'w':
+            writer_count = atoi(optarg);
+            if (writer_count < 0) writer_count = 0;
+            if (writer_count > MAX_THREADS) writer_count = MAX_THREADS;
+            break;
+        case 'c': {
+            int codec = parse_codec(optarg, &compress_level);
+            if (codec < 0) {
+                fprintf(stderr, "[ERROR] Unknown or unavailable compression codec: %s\n", optarg);
+                return 1;
+            }
+            compress_codec = (Codec)codec;
+            break;
+        }
+        case 'X':
+            max_backup_bytes = parse_size(optarg);
+            if (max_backup_bytes < 0) {
+                fprintf(stderr, "[ERROR] Invalid size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            return 1;
+        }
+    }
+    
+    if (optind >= argc && !config_file) {
+        printf("Usage: %s [options] <directory_to_watch> [poll_interval_seconds]\n", argv[0]);
+        printf("       %s [options] --config FILE [poll_interval_seconds]\n", argv[0]);
+        printf("       %s --log|--restore [--at WHEN] [--restore-to DIR] <directory> [FILE...]\n",
+               argv[0]);
+        printf("Options:\n");
+        printf("  --config FILE     Watch every directory listed in FILE, one per line\n");
+        printf("  --poll            Rescan every interval instead of using inotify\n");
+        printf("  -r, --recursive   Track files in subdirectories too\n");
+        printf("  -t, --threads N   Worker threads for walking and hashing (default: CPUs)\n");
+        printf("  -H, --hash ALGO   Content hash: sha256 (default), blake2b%s\n",
+#ifdef HAVE_XXHASH
+               ", xxh3"
+#else
+               ""
+#endif
+               );
+        printf("  --compress CODEC[:LEVEL]\n"
+               "                    Compress plain backups: none (default)%s%s\n",
+#ifdef HAVE_ZSTD
+               ", zstd (level 3)",
+#else
+               "",
+#endif
+#ifdef HAVE_LZ4
+               ", lz4 (level 0)"
+#else
+               ""
+#endif
+               );
+        printf("  --exclude PATTERN Skip files matching a gitignore-style PATTERN (repeatable;\n"
+               "                    each root's %s is applied after these)\n", IGNORE_FILE);
+        printf("  --max-file-size SIZE  Do not back up files larger than SIZE (K/M/G/T)\n");
+        printf("  --io-limit RATE   Cap hashing and backup I/O at RATE bytes/s (K/M/G)\n");
+        printf("  --iops-limit N    Cap hashing and backup I/O at N reads and writes per second\n");
+        printf("  --io-idle         Use the idle I/O class: only touch the disk when it is free\n");
+        printf("  --drop-cache      Drop pages read or written for backups from the page cache\n");
+        printf("  --writers N       Threads writing backups behind detection (default: 2,\n"
+               "                    0 = write them synchronously)\n");
+        printf("  --sync-interval MS  Sync new backups to disk at most once every MS ms, before\n"
+               "                    the state records them (default: %d, 0 = every check)\n",
+               SYNC_INTERVAL_MS);
+        printf("  --single-pass     Hash and copy changed files in one read\n");
+        printf("  --dedup           Store each distinct content once in %s/%s\n",
+               BACKUP_DIR, OBJECTS_DIR);
+        printf("  --chunked         Also split files over 1 MB into deduplicated chunks\n");
+        printf("  --debounce MS     Back up a file once it has been unchanged for MS ms\n");
+        printf("  --rate-limit S    Back up each file at most once every S seconds\n");
+        printf("  --max-poll S      Poll unchanged files down to once every S seconds\n"
+               "                    (default: 8 x poll interval)\n");
+        printf("  --io-uring        Batch stats and overlap reads with io_uring (Linux)\n");
+        printf("  --sample-large    Skip re-hashing files over 64 MB whose size and sampled\n"
+               "                    blocks are unchanged (faster, may miss some edits)\n");
+        printf("  --keep-last N     Retention: keep each file's N newest versions\n");
+        printf("  --keep-hourly N   Retention: keep the newest version of the last N hours\n");
+        printf("  --keep-daily N    Retention: keep the newest version of the last N days\n");
+        printf("  --keep-weekly N   Retention: keep the newest version of the last N weeks\n");
+        printf("  --max-bytes SIZE  Retention: drop oldest versions above SIZE (K/M/G/T)\n");
+        printf("  --migrate-layout  Move backups from the old flat layout into %s/%s and exit\n",
+               BACKUP_DIR, VERSIONS_DIR);
+        printf("  --metrics ADDR    Serve Prometheus metrics at /metrics on [HOST:]PORT\n"
+               "                    (default host 127.0.0.1) or unix:PATH\n");
+        printf("  --stats-interval S  Print a stats line every S seconds\n");
+        printf("  --log             List the backed up versions of FILEs (default: all files)\n");
+        printf("  --restore         Restore FILEs (a directory restores everything below it)\n");
+        printf("  --at WHEN         Use the newest version at WHEN: YYYY-MM-DD[ HH:MM[:SS]],\n"
+               "                    @EPOCH, N[smhdw] ago, or vN for version N (--log then\n"
+               "                    shows the tree as of WHEN)\n");
+        printf("  --restore-to DIR  Restore into DIR instead of over the watched files\n");
+        printf("  --self-test       Run the built-in checks and exit\n");
+        printf("  --bench           Time scan, hash and backup on generated files in a scratch\n"
+               "                    directory inside <directory>, then remove it and exit\n");
+        printf("  --bench-files N   Files to generate (default: 10000)\n");
+        printf("  --bench-size SIZE Mean file size, K/M/G suffixes (default: 16K)\n");
+        printf("  --bench-change P  Percent of the files changed per round (default: 10)\n");
         printf("Example: %s ./my_project 5\n", argv[0]);
         return 1;
     }
     
-    // Get watch directory (remove trailing slash)
-    strncpy(watch_directory, argv[1], MAX_PATH - 1);
-    watch_directory[MAX_PATH - 1] = '\0';
-    size_t len = strlen(watch_directory);
-    if (len > 0 && watch_directory[len - 1] == '/') {
-        watch_directory[len - 1] = '\0';
+    // Get the watch directories: the argument, or the --config list
+    int arg = optind;
+    if (config_file ? load_config(config_file) != 0 : add_root(argv[arg++]) != 0) {
+        return 1;
+    }
+    if (bench && root_count != 1) {
+        fprintf(stderr, "[ERROR] --bench takes a single directory\n");
+        return 1;
+    }
+    
+    // --log/--restore only read the backup store, files follow the directory
+    if (query_log || query_restore) {
+        if (config_file || (query_log && query_restore)) {
+            fprintf(stderr, "[ERROR] --log and --restore take one directory and not both\n");
+            return 1;
+        }
+        root = &roots[0];
+        struct stat st;
+        if (format_path(root->backup_directory, "%s/%s", root->watch_directory, BACKUP_DIR) != 0 ||
+            stat(root->backup_directory, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "[ERROR] No backups in %s\n", root->watch_directory);
+            return 1;
+        }
+        int list_all = query_log && !query_point;
+        if (!query_point) query_at = time(NULL);
+        int failed = run_query(argv + arg, argc - arg, query_restore, list_all, query_at,
+                               query_version, restore_to ? restore_to : root->watch_directory);
+        return failed ? 1 : 0;
     }
     
+    if (keep_last < 0) keep_last = 0;
+    if (keep_hourly < 0) keep_hourly = 0;
+    if (keep_daily < 0) keep_daily = 0;
+    if (keep_weekly < 0) keep_weekly = 0;
+    prune_enabled = keep_last || keep_hourly || keep_daily || keep_weekly || max_backup_bytes;
+    
     // Set poll interval (default 5 seconds)
-    int poll_interval = (argc >= 3) ? atoi(argv[2]) : 5;
+    poll_interval = (arg < argc) ? atoi(argv[arg]) : 5;
     if (poll_interval < 1) poll_interval = 5;
+    if (max_poll_interval == 0) max_poll_interval = poll_interval * 8;
+    if (max_poll_interval < poll_interval) max_poll_interval = poll_interval;
     
-    // Validate directory
-    struct stat st;
-    if (stat(watch_directory, &st) != 0 || !S_ISDIR(st.st_mode)) {
-        fprintf(stderr, "[ERROR] Invalid directory: %s\n", watch_directory);
-        return 1;
+    root = &roots[0];
+    if (bench) {
+        char scratch[MAX_PATH];
+        if (format_path(scratch, "%s/autobackup-bench-XXXXXX", root->watch_directory) != 0 ||
+            !mkdtemp(scratch)) {
+            fprintf(stderr, "[ERROR] Cannot create %s: %s\n", scratch, strerror(errno));
+            return 1;
+        }
+        strcpy(root->watch_directory, scratch);
     }
     
-    // Setup backup directory
-    snprintf(backup_directory, MAX_PATH - 1, "%s/%s", 
-             watch_directory, BACKUP_DIR);
-    create_backup_dir();
+    if (use_uring) {
+#ifdef HAVE_IO_URING
+        if (uring_init(&io_ring, URING_ENTRIES) != 0) {
+            fprintf(stderr, "[WARN] io_uring unavailable (%s), using blocking I/O\n",
+                    strerror(errno));
+            use_uring = 0;
+        }
+#else
+        fprintf(stderr, "[WARN] io_uring not supported on this platform, using blocking I/O\n");
+        use_uring = 0;
+#endif
+    }
     
-    // Load previous state
-    load_state();
+    // I/O limits, before any thread starts so they all inherit the class
+    if (io_idle) {
+        set_idle_io();
+    }
+    io_bytes_bucket.rate = (double)io_limit;
+    io_ops_bucket.rate = iops_limit;
+    io_bytes_bucket.refilled_ns = io_ops_bucket.refilled_ns = monotonic_ns();
+    
+    // Setup backup directories and load previous state, root by root
+    init_gear_table();
+    int migrate_failed = 0;
+    for (int i = 0; i < root_count; i++) {
+        root = &roots[i];
+        if (open_root() != 0) {
+            return 1;
+        }
+        if (migrate) {
+            migrate_failed |= migrate_layout() != 0;
+        } else if (load_root() != 0) {
+            return 1;
+        }
+    }
+    if (migrate) {
+        return migrate_failed ? 1 : 0;
+    }
+    root = &roots[0];
+    start_writers();
+    
+    if (bench) {
+        int failed = run_benchmark();
+        remove_tree(root->watch_directory);
+        return failed ? 1 : 0;
+    }
+    install_stop_handler();
+    
+    if (metrics_address) {
+        pthread_t server;
+        metrics_fd = metrics_listen(metrics_address);
+        if (metrics_fd < 0) {
+            fprintf(stderr, "[ERROR] Cannot serve metrics on %s: %s\n",
+                    metrics_address, strerror(errno));
+            return 1;
+        }
+        if (pthread_create(&server, NULL, metrics_worker, NULL) == 0) {
+            pthread_detach(server);
+            printf("[AutoBackup] Serving metrics on %s\n", metrics_address);
+        } else {
+            fprintf(stderr, "[WARN] Cannot start metrics thread\n");
+        }
+    }
+    if (stats_interval > 0) {
+        pthread_t stats;
+        if (pthread_create(&stats, NULL, stats_worker, NULL) == 0) {
+            pthread_detach(stats);
+        } else {
+            fprintf(stderr, "[WARN] Cannot start stats thread\n");
+        }
+    }
     
     printf("\n╔════════════════════════════════════════════════╗\n");
     printf("║        AutoBackupWatch - File Versioning       ║\n");
     printf("╚════════════════════════════════════════════════╝\n\n");
-    printf("Watching directory: %s\n", watch_directory);
-    printf("Backup location: %s\n", backup_directory);
-    printf("Poll interval: %d seconds\n", poll_interval);
+    for (int i = 0; i < root_count; i++) {
+        printf("Watching directory: %s\n", roots[i].watch_directory);
+        printf("Backup location: %s\n", roots[i].backup_directory);
+    }
+    printf("Poll interval: %d seconds (unchanged files back off to %d)\n",
+           poll_interval, max_poll_interval);
+    printf("Hash algorithm: %s\n", hash_algo_names[hash_algo]);
+    printf("I/O engine: %s\n", use_uring ? "io_uring" : "blocking");
+    if (io_limit || iops_limit || io_idle || drop_cache) {
+        printf("I/O limits: %lld bytes/s, %d ops/s%s%s\n", io_limit, iops_limit,
+               io_idle ? ", idle class" : "", drop_cache ? ", dropping cached pages" : "");
+    }
+    if (writer_count > 0) {
+        printf("Backup writers: %d\n", writer_count);
+    } else {
+        printf("Backup writers: none (backups written synchronously)\n");
+    }
+    printf("Sync interval: %d ms (backups are on disk before the state records them)\n",
+           sync_interval_ms);
+    if (compress_codec != CODEC_NONE) {
+        printf("Compression: %s level %d%s\n", codec_names[compress_codec], compress_level,
+               dedup || chunked ? " (plain backups only, objects are stored raw)" : "");
+    }
+    if (prune_enabled) {
+        printf("Retention: last %d, hourly %d, daily %d, weekly %d, max %lld bytes\n",
+               keep_last, keep_hourly, keep_daily, keep_weekly, max_backup_bytes);
+    }
+    if (debounce_ms > 0 || rate_limit_seconds > 0) {
+        printf("Debounce: %d ms, rate limit: %d s per file\n", debounce_ms, rate_limit_seconds);
+    }
     printf("Press Ctrl+C to stop\n\n");
     
+    // Start watching before the initial scan so no write slips in between
+    int use_events = !use_polling && init_watcher() == 0;
+    
     // Initial scan
-    printf("[AutoBackup] Scanning directory...\n");
-    scan_directory();
-    print_status();
+    for (int i = 0; i < root_count; i++) {
+        root = &roots[i];
+        printf("[AutoBackup] Scanning %s...\n", root->watch_directory);
+        if (scan_directory() != 0) {
+            return 1;
+        }
+        print_status();
+        if (stop_requested) {
+            stop_watching();
+        }
+    }
+    
+    // A root that could not be fully watched is polled on its own; the
+    // others keep their events
+    for (int i = 0; use_events && i < root_count; i++) {
+        if (roots[i].watch_failed) {
+            poll_root(&roots[i]);
+        }
+    }
+    if (use_events && watched_roots() == 0) {
+        fprintf(stderr, "[WARN] No directory could be watched, falling back to polling\n");
+        close(inotify_fd);
+        inotify_fd = -1;
+        use_events = 0;
+    }
+    
+    if (prune_enabled) {
+        pthread_t pruner;
+        if (pthread_create(&pruner, NULL, prune_worker, NULL) == 0) {
+            pthread_detach(pruner);
+        } else {
+            fprintf(stderr, "[WARN] Cannot start pruning thread, retention disabled\n");
+        }
+    }
     
     // Main monitoring loop
-    printf("[AutoBackup] Monitoring for changes...\n\n");
+    printf("[AutoBackup] Monitoring for changes (%s)...\n\n",
+           use_events ? "inotify" : "polling");
+    
+    if (use_events) {
+        // Catch edits made while we were not running
+        for (int i = 0; i < root_count; i++) {
+            root = &roots[i];
+            check_for_changes();
+        }
+        if (stop_requested) {
+            stop_watching();
+        }
+        watch_events();
+    }
     
+    int64_t next_scan = monotonic_ns() + (int64_t)poll_interval * 1000000000;
     while (1) {
-        sleep(poll_interval);
+        // Sleep until the next scan, waking early for deferred checks
+        int timeout = (int)((next_scan - monotonic_ns() + 999999) / 1000000);
+        int due = next_due_timeout();
+        if (due >= 0 && due < timeout) timeout = due;
+        struct pollfd wake = { .fd = wake_pipe[0], .events = POLLIN };
+        if (timeout > 0) poll(&wake, 1, timeout);
+        if (stop_requested) {
+            stop_watching();
+        }
         
-        scan_directory();      // Check for new files
-        check_for_changes();   // Check for modifications
+        finish_backups();
+        if (monotonic_ns() >= next_scan) {
+            for (int i = 0; i < root_count; i++) {
+                root = &roots[i];
+                scan_directory();      // Check for new files
+                poll_for_changes();    // Check files whose poll is due
+            }
+            next_scan = monotonic_ns() + (int64_t)poll_interval * 1000000000;
+        }
+        run_due_checks();
     }
     
     return 0;